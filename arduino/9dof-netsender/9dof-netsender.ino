@@ -23,6 +23,7 @@ LICENSE
 
 #include <Wire.h>
 #include <SPI.h>
+#include <Ticker.h>
 #include <SparkFunLSM9DS1.h>
 
 #include "NetSender.h"
@@ -32,56 +33,121 @@ LSM9DS1 imu;
 #define LSM9DS1_M  0x1E  // Would be 0x1C if SDO_M is LOW
 #define LSM9DS1_AG  0x6B // Would be 0x6A if SDO_AG is LOW
 
+#define SAMPLE_PERIOD 25 // Sample period in milliseconds.
+#define BLOCK_SAMPLES 80 // Samples per block, i.e., 2s of data at 25ms.
+#define NUM_BLOCKS    3  // Blocks, i.e., one being sampled, one being sent and a spare, or about 3KB.
+
 int varsum;
-int currentMillis; 
-int previousMillis;
-                      
-// DataChunk with 800 samples. At 25ms sample rate, this would equate to 20s of data,
-typedef struct DataChunk {
-  unsigned long timestamp;    // returned by millis()
-  unsigned long samplePeriod; // 25ms (configurable)
+
+// DataBlock is a block of raw 16-bit samples, which are scaled to g and
+// gauss by the receiver using the accompanying scale factors.
+typedef struct DataBlock {
+  unsigned long timestamp;    // returned by millis() for the first sample
+  unsigned long samplePeriod; // in milliseconds
   unsigned long nSamples;
-  unsigned long buff;
-  float data[800][6];         // 800 x 6 DOF samples               
+  unsigned long dropped;      // samples dropped prior to this block, because all blocks were full or sampling was late
+  float accelScale;           // g per count
+  float magScale;             // gauss per count
+  int16_t data[BLOCK_SAMPLES][6]; // accelerometer x, y, z and magnetometer x, y, z
 };
 
-DataChunk chunk;
+// The Ticker only counts the sample periods that are due, since I2C
+// reads are not safe from its callback. Samples are instead read from
+// the main loop by the Idler, which NetSender calls while it waits,
+// including while it awaits HTTP replies, and periods missed in the
+// meantime are counted as dropped. Blocks are filled in turn, and each
+// full block is sent as its own chunk, oldest first, as soon as it is
+// ready, so the monitor period should be shorter than a block, i.e.,
+// 2s. Cycles with no block ready skip the network. Since the sampler and
+// the reader both run from the main loop, no locking is required.
+DataBlock blocks[NUM_BLOCKS];
+bool full[NUM_BLOCKS];        // True for a block awaiting upload.
+int filling = 0;              // Block being sampled.
+int sending = -1;             // Block offered as the last chunk, if any.
+int sendingChunk = -1;        // Index of the last chunk.
+unsigned long dropped = 0;
+volatile unsigned long ticks = 0; // Sample periods due, owned by the Ticker.
+unsigned long sampled = 0;        // Sample periods serviced, owned by the main loop.
+Ticker sampler;
+
+// tick is called by the Ticker every sample period.
+void tick() {
+  ticks++;
+}
 
-//9dofReader is the reader that fills a float array with LSM9DS1 9dof data and sends this as a DataChunk
-int dofReader(NetSender::Pin *pin) {
-  if (pin->name[0] != 'B' && pin->name[1] != '0') {
-    return -1;
+// sample appends a sample to the current block, moving on to the next
+// block when it is full.
+void sample() {
+  if (full[filling]) {
+    dropped++; // All blocks are awaiting upload.
+    return;
+  }
+  DataBlock* block = &blocks[filling];
+  imu.readAccel();
+  imu.readMag();
+  if (block->nSamples == 0) {
+    block->timestamp = millis();
+    block->dropped = dropped;
+    dropped = 0;
   }
+  int16_t* row = block->data[block->nSamples++];
+  row[0] = imu.ax;
+  row[1] = imu.ay;
+  row[2] = imu.az;
+  row[3] = imu.mx;
+  row[4] = imu.my;
+  row[5] = imu.mz;
+  if (block->nSamples == BLOCK_SAMPLES) {
+    full[filling] = true;
+    filling = (filling + 1) % NUM_BLOCKS;
+  }
+}
 
-  int sampleCounter = 0;
-
-  //continues to fill data array with sensor values until it is full
-  while (sampleCounter < chunk.nSamples) {
-    yield();
-    currentMillis = millis();
-
-    //does not record a new row until the sample period has passed
-    if (currentMillis - previousMillis > chunk.samplePeriod){
-      previousMillis = currentMillis;
-      delay(1);
-      imu.readAccel();
-      imu.readMag();
-      if (sampleCounter == 0){
-        chunk.timestamp = millis();
+// dofIdler is the Idler, which takes a sample when one is due.
+void dofIdler() {
+  unsigned long due = ticks - sampled;
+  if (due == 0) {
+    return;
+  }
+  sampled += due;
+  dropped += due - 1; // Periods missed while NetSender was busy.
+  sample();
+}
+
+// dofReader is the chunk reader that returns the oldest full block of LSM9DS1 9dof data, without blocking.
+// The chunk index advances only once a chunk has been sent, so the block of the last chunk is released then,
+// whereas it is returned again if the upload failed.
+// Returns binPending if no block is ready yet.
+NetSender::binaryState dofReader(NetSender::Pin *pin, int chunk) {
+  pin->value = -1;
+  if (pin->name[0] != 'B' || pin->name[1] != '0') {
+    return NetSender::binFailed;
+  }
+
+  if (sending != -1 && chunk != sendingChunk) {
+    // The last chunk has been sent, so reuse its block.
+    blocks[sending].nSamples = 0;
+    full[sending] = false;
+    sending = -1;
+  }
+
+  if (sending == -1) {
+    // Blocks are filled in turn, so the oldest full block is the first from the one being filled.
+    for (int ii = 0; ii < NUM_BLOCKS; ii++) {
+      int next = (filling + ii) % NUM_BLOCKS;
+      if (full[next]) {
+        sending = next;
+        break;
       }
-      chunk.data[sampleCounter][0] = imu.calcAccel(imu.ax);
-      chunk.data[sampleCounter][1] = imu.calcAccel(imu.ay);
-      chunk.data[sampleCounter][2] = imu.calcAccel(imu.az);
-      chunk.data[sampleCounter][3] = imu.calcMag(imu.ax);
-      chunk.data[sampleCounter][4] = imu.calcMag(imu.ay);
-      chunk.data[sampleCounter][5] = imu.calcMag(imu.az);
-      sampleCounter++; 
     }
-    yield(); 
   }
-  pin->value = sizeof(DataChunk);
-  pin->data = (byte *)&chunk;
-  return pin->value;
+  if (sending == -1) {
+    return NetSender::binPending;
+  }
+  sendingChunk = chunk;
+  pin->value = sizeof(DataBlock);
+  pin->data = (byte *)&blocks[sending];
+  return NetSender::binPartial; // Sampling is continuous, so there is always more to follow.
 }
 
 // required Arduino routines
@@ -95,17 +161,21 @@ void setup(void) {
   imu.setAccelScale(2); //sets the acceleration scale to +/- 2g
   
   // set up netsender
-  NetSender::BinaryReader = dofReader;
+  NetSender::ChunkReader = dofReader;
+  NetSender::Idler = dofIdler;
   NetSender::init();
   
-  chunk.nSamples = 800;
-  chunk.samplePeriod = 25;
-  previousMillis = millis();
+  for (int ii = 0; ii < NUM_BLOCKS; ii++) {
+    blocks[ii].samplePeriod = SAMPLE_PERIOD;
+    blocks[ii].accelScale = imu.calcAccel(1);
+    blocks[ii].magScale = imu.calcMag(1);
+  }
+  sampler.attach_ms(SAMPLE_PERIOD, tick);
   loop();
 }
 
 void loop() {
   while (!NetSender::run(&varsum)) {
-    delay(RETRY_PERIOD * (long)1000);
+    ;
   }
 }
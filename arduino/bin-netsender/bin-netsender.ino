@@ -34,7 +34,7 @@ byte binData[16] = {'\000', '\001', '\002', '\003', '\004', '\005', '\006', '\00
 // fastReader returns right away.
 int fastReader(NetSender::Pin *pin) {
   pin->value = -1;
-  if (pin->name[0] != 'B' && pin->name[1] != '0') {
+  if (pin->name[0] != 'B' || pin->name[1] != '0') {
     return -1;
   }
 
@@ -44,40 +44,84 @@ int fastReader(NetSender::Pin *pin) {
   return pin->value;
 }
 
-// slowReader requires 3 passes, each 10-seconds long to complete.
-// The pin value and return value are -1 until the reader completes.
-int slowReader(NetSender::Pin *pin) {
-  static int passes = 0;
+// ChunkRtc is the capture progress stored in RTC user memory, which
+// persists across deep sleep but not power loss. Without it, a device
+// that sleeps between cycles would restart its capture on every wake.
+typedef struct {
+  uint32_t check;            // Checksum of the remainder of the struct.
+  long captured;             // Last chunk captured, or -1 if none.
+  unsigned long worked;      // Milliseconds of "work" on the next chunk.
+} ChunkRtc;
+
+#define CHUNK_MAGIC 0x43484b31 // "CHK1", seeds the checksum.
+
+// checksum returns the checksum of RTC data, excluding the checksum itself.
+uint32_t checksum(ChunkRtc* rtc) {
+  uint32_t sum = CHUNK_MAGIC;
+  uint32_t* words = (uint32_t*)rtc;
+  for (size_t ii = 1; ii < sizeof(ChunkRtc) / 4; ii++) {
+    sum = (sum << 1 | sum >> 31) ^ words[ii];
+  }
+  return sum;
+}
 
-  pin->value = -1;
-  if (pin->name[0] != 'B' && pin->name[1] != '0') {
-    return -1;
+// chunkReader sends the binary data in 3 chunks, each of which takes
+// 10 seconds of awake time to "capture". Rather than blocking, it
+// returns pending until the requested chunk is ready, so NetSender
+// skips the network for cycles with nothing to send. The chunk index
+// is maintained by NetSender, so a chunk that fails to send is simply
+// requested again. Progress is kept in RTC memory from RTC_USER_BLOCK,
+// so the capture resumes where it left off after deep sleep.
+NetSender::binaryState chunkReader(NetSender::Pin *pin, int chunk) {
+  static ChunkRtc rtc;
+  static bool loaded = false;
+  static unsigned long last = 0; // Millis at the previous call this wake.
+
+  if (pin->name[0] != 'B' || pin->name[1] != '0') {
+    return NetSender::binFailed;
   }
 
-  delay(10000); // "work" for 10 seconds
-  passes++;
-  Serial.print(F("slowReader: pass ")), Serial.println(passes);
-  if (passes != 3) {
-    return -1; // we're not yet finished
+  if (!loaded) {
+    ESP.rtcUserMemoryRead(RTC_USER_BLOCK, (uint32_t*)&rtc, sizeof(rtc));
+    if (rtc.check != checksum(&rtc)) {
+      rtc.captured = -1;
+      rtc.worked = 0;
+    }
+    loaded = true;
   }
 
-  Serial.println(F("slowReader: complete"));
-  passes = 0; // reset
+  if (chunk != rtc.captured) {
+    unsigned long now = millis();
+    rtc.worked += now - last; // "work" continues while awake
+    last = now;
+    if (rtc.worked >= 10000) {
+      rtc.worked = 0;
+      rtc.captured = chunk;
+      Serial.print(F("chunkReader: captured chunk ")), Serial.println(chunk);
+    }
+    rtc.check = checksum(&rtc);
+    ESP.rtcUserMemoryWrite(RTC_USER_BLOCK, (uint32_t*)&rtc, sizeof(rtc));
+    if (chunk != rtc.captured) {
+      return NetSender::binPending;
+    }
+  }
+
+  // send 16 octets of binary data per chunk
   pin->value = 16;
   pin->data = binData;
-  return pin->value;
+  return chunk < 2 ? NetSender::binPartial : NetSender::binComplete;
 }
 
 // required Arduino routines
 // NB: setup runs everytime ESP8266 comes out of a deep sleep
 void setup(void) {
-  NetSender::BinaryReader = slowReader;
+  NetSender::ChunkReader = chunkReader;
   NetSender::init();
   loop();
 }
 
 void loop() {
   while (!NetSender::run(&varsum)) {
-    delay(RETRY_PERIOD * (long)1000);
+    ;
   }
 }
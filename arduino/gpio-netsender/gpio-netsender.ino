@@ -43,6 +43,6 @@ void setup(void) {
 
 void loop() {
   while (!NetSender::run(&varsum)) {
-    delay(RETRY_PERIOD * (long)1000);
+    ;
   }
 }
@@ -25,11 +25,17 @@
 #include <limits.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#ifdef ARDUINO
 #include <ESP8266WiFi.h>
 #include <ESP8266HTTPClient.h>
 #include <WiFiClient.h>
-#include <EEPROM.h>
-//#include "nonarduino.h"
+#include <LittleFS.h>
+#include <Ticker.h>
+#else
+#include "nonarduino.h" // Host syntax checking only.
+#endif
 
 #include "NetSender.h"
 
@@ -49,11 +55,48 @@ namespace NetSender {
 #define DEFAULT_WIFI           "netreceiver,netsender"     // Default WiFi credentials.
 
 #define MAC_SIZE               18    // Size of a string MAC address.
-#define MAX_PATH               256   // Maximum URL path size.
-#define RETRY_PERIOD           5     // Seconds between retrying after a failure.
+#define MAX_PATH               (128 + MAX_PINS * (PIN_SIZE + 12)) // Maximum URL path size, i.e., the header and every pin.
+#define MAX_HOST               128   // Maximum service URL size, i.e., scheme and host.
+#define MAX_URL                (MAX_HOST + MAX_PATH) // Maximum URL size.
+#define MAX_SERVICE            48    // Maximum size of a permanently redirected service URL, which is kept in RTC memory.
+#define MAX_REPLY              1024  // Maximum reply size.
+#define RETRY_PERIOD           5     // Seconds before retrying after a first failure.
+#define MAX_BACKOFF            3600  // Maximum seconds between retries (see backoffPeriod).
+#define SLEEP_BACKOFF          60    // Minimum seconds between retries for which we deep sleep.
+#define SYNC_PERIOD            600   // Minimum seconds between clock syncs used to estimate drift.
+#define SYNC_EXPIRY            86400 // Seconds after which a clock sync is no longer used for scheduling.
+#define MAX_DRIFT              100000 // Maximum clock drift estimate in parts per million, i.e., 10%.
 #define WIFI_ATTEMPTS          100   // Number of WiFi attempts
 #define WIFI_DELAY             100   // Milliseconds between WiFi attempts.
+#define WIFI_RESUME_TIMEOUT    3000  // Millisecond timeout for reconnecting with cached WiFi settings.
+#define WIFI_LEASE             3600  // Seconds for which cached WiFi settings, including the DHCP lease, are reused.
 #define HTTP_TIMEOUT           10000 // Millisecond timeout for HTTP connection and request attempts.
+#define MAX_REDIRECTS          3     // Maximum number of HTTP redirects followed per request.
+#define MAX_SAMPLES            4     // Maximum number of samples buffered in RTC memory, and so the BatchSize limit.
+#define MAX_TASKS              6     // Maximum number of concurrent tasks.
+#define MAX_READINGS           64    // Size of the sampler queue, which holds one less reading.
+#define AGGREGATE_PIN          70    // First of the X pins for aggregate statistics (see aggregateTask).
+#define PHASE_PIN              80    // First of the X pins for min/max phase times and the chunk index (see xIndex).
+#define TIMER_FREQUENCY        5000000 // Timer ticks per second, i.e., 80MHz / 16.
+#define JOURNAL_SIZE           4096  // Size of the config journal, which is one flash sector.
+#define JOURNAL_MAGIC          0x324A534E // Config journal magic number ("NSJ2").
+#define CONFIG_SIZE            1024  // Maximum size of the stored config, a multiple of 4.
+#define SAMPLE_PINS            10    // Maximum number of inputs that can be buffered, batched or queued.
+#define PIN_POOL               48    // Number of pins shared by inputs and outputs.
+#define COMPACT_SIZE           (16 + MAX_PINS * 8) // Maximum size of a compact request body.
+#define MAX_BATCH              16    // Maximum number of samples in a batched poll, which is at least MAX_SAMPLES.
+#define BATCH_SIZE             (2 + MAX_BATCH * (18 + SAMPLE_PINS * (PIN_SIZE + 16))) // Maximum size of a batched poll body.
+#define QUEUE_SIZE             32768 // Size of each store-and-forward queue file.
+#define QUEUE_BATCHES          8     // Maximum number of queued batches sent per cycle.
+#define MAX_CHUNKS             8     // Maximum number of binary chunks sent per cycle.
+#define QUEUE_FILE             "/queue"     // Queue file being appended.
+#define QUEUE_OLD_FILE         "/queue.old" // Full queue file, which is sent first.
+#define LZ_HASH_BITS           10    // Log2 of the number of compressor hash table entries, each 2 bytes.
+#define LZ_MIN_MATCH           4     // Minimum LZ4 match length.
+#define LZ_MATCH_LIMIT         12    // LZ4 matches start at least this many bytes before the end of the data,
+#define LZ_LAST_LITERALS       5     // and finish at least this many bytes before it.
+#define LZ_MAX_OFFSET          65535 // Maximum LZ4 match offset.
+#define LZ_RUN_SIZE            16    // Size of the buffer for LZ4 tokens, offsets and length runs.
 
 // Constants:
 enum bootReason {
@@ -72,6 +115,18 @@ enum httpStatusCode {
   httpPermanentRedirect = 308,
 };
 
+// Wire formats for poll and act requests, negotiated with config requests ("cf").
+enum wireFormat {
+  wireText    = 0, // Pins are sent as URL query parameters.
+  wireCompact = 1, // Pins are sent as a binary body (see compactBody).
+};
+
+// Binary payload encodings, as selected by the Compression var.
+enum payloadEncoding {
+  encodeNone = 0, // Binary data is sent as is.
+  encodeLz4  = 1, // Binary data is sent as LZ4 blocks, one per pin (see Lz4Stream).
+};
+
 // Service response codes.
 enum rcCode {
   rcOK      = 0,
@@ -96,6 +151,16 @@ enum pvIndex {
   pvAlarmVoltage,
   pvAlarmRecoveryVoltage,
   pvPeakVoltage,
+  pvBatchSize,      // Samples per batched poll, or 0 for the maximum, which is MAX_SAMPLES, i.e., 4.
+  pvBatchPeriod,
+  pvDeadband,
+  pvSilencePeriod,
+  pvSampleRate,
+  pvAggregatePin,
+  pvAggregateRate,
+  pvAggregateCount,
+  pvPhase,
+  pvCompression,
 };
 
 const char* PvNames[] = {
@@ -108,29 +173,80 @@ const char* PvNames[] = {
   "AlarmNetwork",
   "AlarmVoltage",
   "AlarmRecoveryVoltage",
-  "PeakVoltage"
+  "PeakVoltage",
+  "BatchSize",
+  "BatchPeriod",
+  "Deadband",
+  "SilencePeriod",
+  "SampleRate",
+  "AggregatePin",
+  "AggregateRate",
+  "AggregateCount",
+  "Phase",
+  "Compression"
 };
 
+// usedVars returns a bit mask of the vars, in pvIndex order, which
+// are used by the compiled subsystems. Other vars are not requested.
+uint32_t usedVars() {
+  uint32_t mask = (1UL << MAX_VARS) - 1;
+  if (!NetSenderTraits::pulses) {
+    mask &= ~(1UL << pvPulses | 1UL << pvPulseWidth | 1UL << pvPulseDutyCycle | 1UL << pvPulseCycle);
+  }
+  if (!NetSenderTraits::alarms) {
+    mask &= ~(1UL << pvAlarmPeriod | 1UL << pvAlarmNetwork | 1UL << pvAlarmVoltage | 1UL << pvAlarmRecoveryVoltage);
+  }
+  return mask;
+}
+
 // X pins
 enum xIndex {
   xSizeBW,
   xDownBW,
   xUpBW,
-  x3,
-  x4,
-  x5,
-  x6,
-  x7,
-  x8,
-  x9,
+  xReadMean,     // Mean phase times in microseconds, in timerIndex order.
+  xWifiOnMean,
+  xAssociateMean,
+  xDhcpMean,
+  xHttpMean,
+  xParseMean,
+  xCommitMean,
   xA0,
   xAlarmed,
   xAlarms,
   xBoot,
   xPulseSuppress,
+  xReadMin,      // Minimum phase times, which, like those that follow, are numbered from PHASE_PIN, i.e., X80-X86.
+  xWifiOnMin,
+  xAssociateMin,
+  xDhcpMin,
+  xHttpMin,
+  xParseMin,
+  xCommitMin,
+  xReadMax,      // Maximum phase times, i.e., X87-X93.
+  xWifiOnMax,
+  xAssociateMax,
+  xDhcpMax,
+  xHttpMax,
+  xParseMax,
+  xCommitMax,
+  xChunk,        // Index of the binary chunk being sent (see ChunkReader), i.e., X94.
   xMax
 };
 
+// Timed phases of a cycle.
+// NB: Keep in sync with the corresponding X pins.
+enum timerIndex {
+  tRead,      // Reading input pins.
+  tWifiOn,    // Turning on the WiFi.
+  tAssociate, // Associating with a hotspot.
+  tDhcp,      // Obtaining an IP address.
+  tHttp,      // Each HTTP request, including redirects.
+  tParse,     // Parsing a JSON reply.
+  tCommit,    // Writing the configuration to EEPROM.
+  tMax
+};
+
 // PowerPin describes a power pin, i.e., a pin controlling a relay.
 typedef struct {
   int pin;          // GPIO pin connected to the relay.
@@ -147,34 +263,171 @@ PowerPin PowerPins[] = {
   {15,        "Power3", false},
 };
 
-// Variable types, which include both persistent vars and vars associated with power pins. PulseSuppress is included for convenience.
-const char* VarTypes = "{\"Pulses\":\"uint\", \"PulseWidth\":\"uint\", \"PulseDutyCycle\":\"uint\", \"PulseCycle\":\"uint\", \"AutoRestart\":\"uint\", \"AlarmPeriod\":\"uint\", \"AlarmNetwork\":\"uint\", \"AlarmVoltage\":\"uint\", \"AlarmRecoveryVoltage\":\"uint\", \"PeakVoltage\":\"uint\", \"Alarm\":\"bool\", \"Power1\":\"bool\", \"Power2\":\"bool\", \"Power3\":\"bool\", \"PulseSuppress\":\"bool\"}";
+// PinFunc represents a function that reads or writes a pin with the given number.
+// Readers return the value read, or -1 upon error.
+typedef int (*PinFunc)(Pin *, int);
+
+// PinDesc is a pin descriptor, compiled from a pin name by compilePin,
+// which allows pins to be read and written without parsing their names.
+typedef struct {
+  PinFunc func;      // Reader for inputs, writer for outputs.
+  PowerPin * power;  // Power pin for digital pins that control a relay, else NULL.
+  int16_t number;    // Pin number.
+  char type;         // Pin type, i.e., 'A', 'B', 'D' or 'X'.
+} PinDesc;
+
+// PinTable is a compiled list of pins, i.e., inputs or outputs,
+// allocated from the pin pool and terminated by a pin with no name.
+typedef struct {
+  Pin * pins;
+  PinDesc * descs;
+  int size;          // Number of pins in use.
+} PinTable;
+
+// Variable types, which include both persistent vars and vars associated with power pins, if any. PulseSuppress is included for convenience.
+#define PV_TYPES     "\"Pulses\":\"uint\", \"PulseWidth\":\"uint\", \"PulseDutyCycle\":\"uint\", \"PulseCycle\":\"uint\", \"AutoRestart\":\"uint\", \"AlarmPeriod\":\"uint\", \"AlarmNetwork\":\"uint\", \"AlarmVoltage\":\"uint\", \"AlarmRecoveryVoltage\":\"uint\", \"PeakVoltage\":\"uint\", \"BatchSize\":\"uint\", \"BatchPeriod\":\"uint\", \"Deadband\":\"uint\", \"SilencePeriod\":\"uint\", \"SampleRate\":\"uint\", \"AggregatePin\":\"uint\", \"AggregateRate\":\"uint\", \"AggregateCount\":\"uint\", \"Phase\":\"uint\", \"Compression\":\"uint\""
+#define POWER_TYPES  ", \"Alarm\":\"bool\", \"Power1\":\"bool\", \"Power2\":\"bool\", \"Power3\":\"bool\""
+#define PULSE_TYPES  ", \"PulseSuppress\":\"bool\""
+const char* VarTypes = NetSenderTraits::power ? "{" PV_TYPES POWER_TYPES PULSE_TYPES "}" : "{" PV_TYPES PULSE_TYPES "}";
+
+// Sample represents a set of buffered input values.
+typedef struct {
+  unsigned long time;    // Sample time in seconds (see clockTime).
+  int values[SAMPLE_PINS]; // Values, in the same order as Config.inputs.
+} Sample;
+
+// SampleBuffer is a ring buffer of samples awaiting a batched poll.
+typedef struct {
+  int cycles;            // Cycles since the last batched poll.
+  int head;              // Index of the oldest sample.
+  int count;             // Number of samples in use.
+  Sample samples[MAX_SAMPLES];
+} SampleBuffer;
+
+// WifiCache holds the settings from the last successful WiFi connection,
+// which are reused to reconnect quickly, i.e., without scanning or DHCP.
+typedef struct {
+  uint32_t wifi;         // CRC-32 of the WiFi credentials, or 0 if the cache is empty.
+  unsigned long time;    // Time the settings were obtained (see clockTime).
+  uint8_t bssid[6];      // Access point BSSID.
+  uint8_t channel;       // WiFi channel.
+  uint8_t unused;
+  uint32_t ip;           // DHCP-assigned IP address.
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+} WifiCache;
+
+// Timer holds running statistics for a timed phase, in microseconds.
+typedef struct {
+  uint32_t min;
+  uint32_t max;
+  uint32_t mean;
+  uint16_t count;        // Number of timings, which saturates.
+  uint16_t unused;
+} Timer;
+
+// ClockSync relates our clock to server time, which is obtained from
+// the Date header of HTTP replies, for scheduling cycles (see scheduledDelay).
+typedef struct {
+  uint32_t time;         // Server time (Unix seconds) when last synced, or 0 if never synced.
+  uint32_t clock;        // Our clock (see clockMillis) when last synced.
+  int32_t drift;         // Server time gained per unit of our time, in parts per million.
+} ClockSync;
+
+// RtcData is data stored in RTC user memory, which persists across deep sleep but not power loss.
+// NB: RTC user memory is limited to 512 bytes, of which blocks from RTC_USER_BLOCK are left to sketches.
+typedef struct {
+  uint32_t crc;          // CRC-32 of the remainder of the struct.
+  unsigned long clock;   // Seconds elapsed before the current wake, including time spent deep sleeping.
+  SampleBuffer buffer;
+  Sample sent;           // Input values last sent, for deadband suppression.
+  WifiCache wifi;
+  Timer timers[tMax];
+  uint32_t queued;       // Offset of the first unsent sample in the store-and-forward queue.
+  uint16_t failures;     // Network failures since the last success or network alarm.
+  uint16_t retries;      // Consecutive failed cycles, which determines the backoff.
+  uint16_t chunk;        // Index of the next binary chunk to send (see ChunkReader).
+  uint16_t residue;      // Milliseconds of the clock in excess of whole seconds.
+  ClockSync sync;
+  char service[MAX_SERVICE]; // Service URL after a permanent redirect, or empty for SVC_URL.
+} RtcData;
+
+#ifdef ARDUINO // NB: Longs are bigger on 64-bit hosts.
+static_assert(sizeof(RtcData) <= RTC_USER_BLOCK * 4, "RtcData exceeds RTC_USER_BLOCK");
+#endif
 
 // Exported globals.
 Configuration Config;
 ReaderFunc ExternalReader = NULL;
 ReaderFunc BinaryReader = NULL;
+ChunkReaderFunc ChunkReader = NULL;
 int VarSum = 0;
 bool Debug = false;
+bool EarlyWiFi = false;
+SamplerFunc Sampler = NULL;
+IdleFunc Idler = NULL;
+
+// debugging returns true if debug output is enabled, which is never
+// the case if it is compiled out (see NetSenderTraits).
+inline bool debugging() {
+  return NetSenderTraits::debug && Debug;
+}
 
 // Other globals.
 static int XPin[xMax] = {100000, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0};
 static bool Configured = false;
+static bool Woke = false; // True if we woke from deep sleep, rather than booting.
+static byte Mac[6];
 static char MacAddress[MAC_SIZE];
 static IPAddress LocalAddress;
 static unsigned long Time = 0;
 static unsigned long AlarmedTime = 0;
-static int NetworkFailures = 0;
+static unsigned long TemporaryAlarmTime = 0;
 static int SimulatedA0 = 0;
+static RtcData Rtc;
+static Pin PinPool[PIN_POOL];
+static PinDesc DescPool[PIN_POOL];
+static PinTable Inputs;  // Compiled from Config.inputs by initPins.
+static PinTable Outputs; // Compiled from Config.outputs by initPins.
+
+// HTTP session globals. The session is kept alive while WiFi is on so
+// that consecutive requests within a cycle share one TCP connection.
+// Request buffers are statically allocated, not on the heap, so that
+// memory use is bounded and heap fragmentation is avoided.
+void idle();
+
+// IdleClient is a WiFiClient that calls the Idler, if any, whenever it
+// is polled, e.g., by HTTPClient while it awaits a reply.
+class IdleClient : public WiFiClient {
+public:
+  using WiFiClient::read;
+  int available() override { idle(); return WiFiClient::available(); }
+  int read() override { idle(); return WiFiClient::read(); }
+  uint8_t connected() override { idle(); return WiFiClient::connected(); }
+};
+
+static IdleClient Client;
+static HTTPClient Http;
+static char SessionURL[MAX_HOST] = "";      // Service URL of the open connection, if any.
+static char Reply[MAX_REPLY];               // Reply to the last request.
+static char Body[BATCH_SIZE];               // Body of a batched poll.
+static Sample Backlog[MAX_BATCH];           // Samples read from the store-and-forward queue.
+static bool Queueing = false;               // True if the queue's file system is mounted.
 
 // Forward declarations.
 void restart(bootReason, bool);
+bool complete(unsigned long, long);
+void compilePin(const char *, PinDesc *, bool);
+void httpClose();
+void writeConfig(Configuration*);
+void writeRtc();
 
 // Utilities:
 
 // padcopy copies a string, padding with null characters
 void padCopy(char * dst, const char * src, size_t size) {
-  int ii = 0;
+  size_t ii = 0;
   for (; ii < size - 1 && ii < strlen(src); ii++) {
     dst[ii] = src[ii];
   }
@@ -183,6 +436,17 @@ void padCopy(char * dst, const char * src, size_t size) {
   }
 }
 
+// appendf appends formatted text to the string in buf, which is size
+// bytes, returning false if the text was truncated.
+bool appendf(char * buf, size_t size, const char * fmt, ...) {
+  size_t len = strlen(buf);
+  va_list args;
+  va_start(args, fmt);
+  int nn = vsnprintf(buf + len, size - len, fmt, args);
+  va_end(args);
+  return nn >= 0 && len + nn < size;
+}
+
 // fmtMacAddress formats a MAC address.
 char * fmtMacAddress(byte mac[6], char str[MAC_SIZE]) {
   const char* hexDigits = "0123456789ABCDEF";
@@ -196,43 +460,348 @@ char * fmtMacAddress(byte mac[6], char str[MAC_SIZE]) {
   return str;
 }
 
-// extractJson gets a string or integer value from JSON.
-// NB: This is NOT a general-purpose JSON parser.
-bool extractJson(String json, const char * name, String& value) {
-  int finish, start = json.indexOf(String("\"") + String(name) + "\"");
-  if (start == -1) return false;
-  start += strlen(name) + 3; // skip quotes and colon
-  while (json.charAt(start) == ' ') {
-    start++;
+// crc32 computes a CRC-32 (IEEE) checksum, continuing from a previous checksum, if any.
+uint32_t crc32(const unsigned char * data, size_t size, uint32_t crc=0) {
+  crc = ~crc;
+  for (size_t ii = 0; ii < size; ii++) {
+    crc ^= data[ii];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
   }
-  switch (json.charAt(start)) {
-  case '-': case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
-    finish = json.indexOf(',', start);
-    break;
-  case '"':
-    finish = json.indexOf('"', ++start);
-    break;
-  default:
-    return false;
+  return ~crc;
+}
+
+// elapsedMillis calculates elapsed milliseconds taking into account rollover.
+// Note that an unsigned long is only 32 bits.
+unsigned long elapsedMillis(unsigned long from) {
+  unsigned long elapsed, now = millis();
+  if (now >= from) {
+    elapsed = now - from;
+  } else {
+    elapsed = (0xffffffff - from) + now; // Rolled over.
+  }
+  return elapsed;
+}
+
+// Timing utilities:
+
+// stopTimer records the duration of a phase started at the given time
+// in microseconds, updating the corresponding X pins. Once the count
+// saturates, the mean becomes an exponential moving average.
+void stopTimer(timerIndex index, unsigned long start) {
+  Timer * timer = &Rtc.timers[index];
+  uint32_t us = micros() - start;
+  if (timer->count == 0 || us < timer->min) {
+    timer->min = us;
+  }
+  if (timer->count == 0 || us > timer->max) {
+    timer->max = us;
+  }
+  if (timer->count < 0xFFFF) {
+    timer->count++;
+  }
+  timer->mean += ((long)us - (long)timer->mean) / (long)timer->count;
+  XPin[xReadMean + index] = timer->mean;
+  XPin[xReadMin + index] = timer->min;
+  XPin[xReadMax + index] = timer->max;
+}
+
+// initTimers sets the X pins of all timers, with -1 denoting phases not yet timed.
+void initTimers() {
+  for (int ii = 0; ii < tMax; ii++) {
+    Timer * timer = &Rtc.timers[ii];
+    XPin[xReadMean + ii] = timer->count == 0 ? -1 : timer->mean;
+    XPin[xReadMin + ii] = timer->count == 0 ? -1 : timer->min;
+    XPin[xReadMax + ii] = timer->count == 0 ? -1 : timer->max;
+  }
+}
+
+// JSON utilities:
+// NB: These are NOT a general-purpose JSON parser. Only top-level
+// members of an object are extracted and string escapes are not
+// decoded. Nothing is allocated; extracted values point into the JSON.
+
+// JsonField represents a JSON member to be extracted by parseJson.
+// A NULL name terminates a table of fields.
+typedef struct {
+  const char * name;    // Name of the member.
+  bool prefixed;        // True if the name may have a dotted prefix, e.g., "id.Pulses".
+  const char * value;   // Value, excluding quotes, else NULL if not found.
+  int size;             // Size of the value.
+  const char * prefix;  // Prefix, excluding the dot, if any.
+  int prefixSize;       // Size of the prefix.
+} JsonField;
+
+// skipSpace returns a pointer to the first non-whitespace character.
+const char * skipSpace(const char * cp) {
+  while (*cp == ' ' || *cp == '\t' || *cp == '\r' || *cp == '\n') {
+    cp++;
+  }
+  return cp;
+}
+
+// skipString returns a pointer to the closing quote of a string, where
+// cp points just past the opening quote, else NULL if unterminated.
+const char * skipString(const char * cp) {
+  for (; *cp != '\0'; cp++) {
+    if (*cp == '\\') {
+      if (*++cp == '\0') break;
+    } else if (*cp == '"') {
+      return cp;
+    }
+  }
+  return NULL;
+}
+
+// skipNested returns a pointer just past a nested object or array, else NULL if unterminated.
+const char * skipNested(const char * cp) {
+  int depth = 0;
+  for (; *cp != '\0'; cp++) {
+    switch (*cp) {
+    case '"':
+      cp = skipString(cp + 1);
+      if (cp == NULL) return NULL;
+      break;
+    case '{': case '[':
+      depth++;
+      break;
+    case '}': case ']':
+      if (--depth == 0) return cp + 1;
+      break;
+    }
+  }
+  return NULL;
+}
+
+// matchFields records a member's value in every field that matches its key.
+// For prefixed fields, a match with a prefix takes precedence over one without.
+void matchFields(JsonField ** tables, const char * key, int keySize, const char * value, int size) {
+  for (; *tables != NULL; tables++) {
+    for (JsonField * field = *tables; field->name != NULL; field++) {
+      int nameSize = strlen(field->name);
+      int prefixSize = keySize - nameSize - 1;
+      if (keySize == nameSize && strncmp(key, field->name, nameSize) == 0) {
+        prefixSize = 0;
+      } else if (!field->prefixed || prefixSize <= 0 || key[prefixSize] != '.' || strncmp(key + prefixSize + 1, field->name, nameSize) != 0) {
+        continue;
+      }
+      if (prefixSize == 0 && field->prefixSize > 0) {
+        continue; // Prefixed matches take precedence.
+      }
+      field->value = value;
+      field->size = size;
+      field->prefix = key;
+      field->prefixSize = prefixSize;
+    }
   }
-  if (finish == -1) finish = json.length();
-  value = json.substring(start, finish);
-  return true;
 }
 
-// longDelay is currently just a wrapper for delay, with a warning if WiFi is connected.
+// parseJson walks a JSON object once, extracting the values of members
+// that match the given NULL-terminated list of field tables.
+// Returns false if the JSON is malformed.
+bool parseJson(const char * json, JsonField ** tables) {
+  const char * cp = skipSpace(json);
+  if (*cp++ != '{') return false;
+  for (;;) {
+    cp = skipSpace(cp);
+    if (*cp == '}') return true;
+    if (*cp++ != '"') return false;
+    const char * key = cp;
+    cp = skipString(cp);
+    if (cp == NULL) return false;
+    int keySize = cp++ - key;
+    cp = skipSpace(cp);
+    if (*cp++ != ':') return false;
+    cp = skipSpace(cp);
+    const char * value = cp;
+    switch (*cp) {
+    case '"':
+      value = ++cp;
+      cp = skipString(cp);
+      if (cp == NULL) return false;
+      matchFields(tables, key, keySize, value, cp++ - value);
+      break;
+    case '{': case '[':
+      cp = skipNested(cp);
+      if (cp == NULL) return false;
+      matchFields(tables, key, keySize, value, cp - value);
+      break;
+    default:
+      while (*cp != '\0' && *cp != ',' && *cp != '}' && !isspace(*cp)) {
+        cp++;
+      }
+      if (cp == value) return false;
+      matchFields(tables, key, keySize, value, cp - value);
+    }
+    cp = skipSpace(cp);
+    if (*cp == ',') {
+      cp++;
+    } else if (*cp != '}') {
+      return false;
+    }
+  }
+}
+
+// jsonField returns an initialized field for the given name.
+JsonField jsonField(const char * name, bool prefixed=false) {
+  JsonField field = {name, prefixed, NULL, 0, NULL, 0};
+  return field;
+}
+
+// findField returns the field with the given name in a table, else NULL.
+JsonField * findField(JsonField * fields, const char * name) {
+  for (; fields->name != NULL; fields++) {
+    if (strcmp(fields->name, name) == 0) {
+      return fields;
+    }
+  }
+  return NULL;
+}
+
+// fieldInt returns the integer value of a field, which may be quoted.
+int fieldInt(JsonField * field) {
+  const char * cp = field->value;
+  int size = field->size;
+  int val = 0;
+  bool neg = (size > 0 && *cp == '-');
+  if (neg) {
+    cp++, size--;
+  }
+  for (; size > 0 && isdigit(*cp); cp++, size--) {
+    val = val * 10 + (*cp - '0');
+  }
+  return neg ? -val : val;
+}
+
+// fieldEquals returns true if the value of a field equals the given string.
+bool fieldEquals(JsonField * field, const char * str) {
+  return strlen(str) == (size_t)field->size && strncmp(field->value, str, field->size) == 0;
+}
+
+// fieldCopy copies the value of a field, truncating if necessary and
+// padding with null characters.
+void fieldCopy(JsonField * field, char * dst, size_t size) {
+  size_t ii = 0;
+  for (; ii < size - 1 && ii < (size_t)field->size; ii++) {
+    dst[ii] = field->value[ii];
+  }
+  for (; ii < size; ii++) {
+    dst[ii] = '\0';
+  }
+}
+
+// printField prints the value of a field.
+void printField(JsonField * field) {
+  Serial.write((const uint8_t *)field->value, field->size);
+  Serial.println(F(""));
+}
+
+// idle calls the Idler, if any.
+void idle() {
+  if (Idler != NULL) {
+    (*Idler)();
+  }
+}
+
+// idleDelay is a wrapper for delay, which calls the Idler, if any, every millisecond.
+void idleDelay(unsigned long ms) {
+  if (Idler == NULL) {
+    delay(ms);
+    return;
+  }
+  for (unsigned long start = millis(); millis() - start < ms; ) {
+    idle();
+    delay(1);
+  }
+}
+
+// longDelay is a wrapper for idleDelay, with a warning if WiFi is connected.
 void longDelay(unsigned long ms) {
   if (WiFi.status() == WL_CONNECTED) {
     Serial.println(F("Warning: longDelay called while WiFi is connected."));
   }
-  delay(ms);
+  idleDelay(ms);
+}
+
+// Cooperative tasks:
+// A task is a non-blocking function that performs one step of work each
+// time it is called, returning true once it is done. Tasks run
+// concurrently until done, interleaved by runTasks and finishTasks.
+// Background tasks, such as pulsing, may continue to run after runTasks
+// returns, e.g., while HTTP requests are made, and are always completed
+// by finishTasks before the cycle pauses.
+
+// TaskFunc represents a task function.
+typedef bool (*TaskFunc)();
+
+typedef struct {
+  TaskFunc func;
+  bool background;
+  bool done;
+} Task;
+
+static Task Tasks[MAX_TASKS];
+static int NumTasks = 0;
+
+// addTask adds a task, unless it is already running. If there is no
+// room for the task, it is run to completion right away.
+void addTask(TaskFunc func, bool background=false) {
+  for (int ii = 0; ii < NumTasks; ii++) {
+    if (Tasks[ii].func == func) {
+      Tasks[ii].done = false;
+      return;
+    }
+  }
+  if (NumTasks == MAX_TASKS) {
+    if (debugging()) Serial.println(F("Warning: Too many tasks"));
+    while (!(*func)()) {
+      idleDelay(1);
+    }
+    return;
+  }
+  Tasks[NumTasks].func = func;
+  Tasks[NumTasks].background = background;
+  Tasks[NumTasks].done = false;
+  NumTasks++;
+}
+
+// tickTasks calls each task that is not done once, returning true if
+// all tasks, or all foreground tasks if all is false, are done.
+bool tickTasks(bool all) {
+  bool done = true;
+  for (int ii = 0; ii < NumTasks; ii++) {
+    if (!Tasks[ii].done) {
+      Tasks[ii].done = (*Tasks[ii].func)();
+    }
+    if (!Tasks[ii].done && (all || !Tasks[ii].background)) {
+      done = false;
+    }
+  }
+  return done;
+}
+
+// runTasks runs tasks until all foreground tasks are done.
+// NB: idleDelay(1) yields to the WiFi stack between ticks.
+void runTasks() {
+  while (!tickTasks(false)) {
+    idleDelay(1);
+  }
+}
+
+// finishTasks runs tasks until all tasks are done, then clears them.
+void finishTasks() {
+  while (!tickTasks(true)) {
+    idleDelay(1);
+  }
+  NumTasks = 0;
 }
 
 // Initializing and reading/writing pins:
 
 // getPowerPin returns the power pin for the given pin number, else NULL.
 PowerPin * getPowerPin(int pin) {
-  for (int ii = 0; ii < NUM_RELAYS; ii++) {
+  for (int ii = 0; NetSenderTraits::power && ii < NUM_RELAYS; ii++) {
     if (PowerPins[ii].pin == pin) {
       return &PowerPins[ii];
     }
@@ -240,166 +809,598 @@ PowerPin * getPowerPin(int pin) {
   return NULL;
 }
 
-// setPins sets pin names in the Pin array from comma-separated names, clears unused pins and returns the size in use.
-int setPins(const char * names, Pin * pins) {
-  char *start = (char *)names;
+// setPins sets pin names in the Pin array from comma-separated names,
+// followed by a pin with no name, and returns the size in use, which
+// is at most max. Names that are too long are skipped.
+int setPins(const char * names, Pin * pins, int max) {
+  const char * start = names;
   int ii = 0;
-  for (; ii < MAX_PINS; ii++) {
-    char * finish = strchr(start, ',');
+  while (*start != '\0') {
+    const char * finish = strchr(start, ',');
     if (finish == NULL) {
-      strcpy(pins[ii].name, start);
-      ++ii;
+      finish = start + strlen(start);
+    }
+    if (ii == max) {
+      if (debugging()) Serial.print(F("Warning: Too many pins, ignoring ")), Serial.println(start);
       break;
     }
-    strncpy(pins[ii].name, start, finish-start);
-    pins[ii].name[finish-start] = '\0';
-    start = finish + 1;
-  }
-  int sz = ii;
-  for (; ii < MAX_PINS; ii++) {
-    pins[ii].name[0] = '\0';
+    if (finish - start >= PIN_SIZE) {
+      if (debugging()) Serial.print(F("Warning: Pin name too long: ")), Serial.println(start);
+    } else {
+      memcpy(pins[ii].name, start, finish - start);
+      pins[ii++].name[finish - start] = '\0';
+    }
+    start = *finish == ',' ? finish + 1 : finish;
   }
-  return sz;
+  pins[ii].name[0] = '\0';
+  return ii;
 }
 
 // resetPowerPins resets all power pins.
 void resetPowerPins() {
-  for (int ii = 0; ii < NUM_RELAYS; ii++) {
+  for (int ii = 0; NetSenderTraits::power && ii < NUM_RELAYS; ii++) {
     if (PowerPins[ii].alarm) {
       continue;
     }
     pinMode(PowerPins[ii].pin, OUTPUT);
     digitalWrite(PowerPins[ii].pin, LOW);
-    if (Debug) Serial.print(F("Reset power pin: D")), Serial.println(PowerPins[ii].pin);
+    if (debugging()) Serial.print(F("Reset power pin: D")), Serial.println(PowerPins[ii].pin);
   }
 }
 
-// initPins initializes digital pins. On startup, power pins are also initialized.
-void initPins(bool startup) {
-  Pin pins[MAX_PINS];
+// compilePins compiles comma-separated pin names into the given table,
+// for reading or, when output is true, writing, allocating pins from
+// the pool starting at first. It returns the next unallocated pin.
+int compilePins(const char * names, PinTable * table, bool output, int first) {
+  int max = PIN_POOL - first - 1;
+  if (max > MAX_PINS) {
+    max = MAX_PINS;
+  }
+  table->pins = &PinPool[first];
+  table->descs = &DescPool[first];
+  table->size = setPins(names, table->pins, max);
+  for (int ii = 0; ii < table->size; ii++) {
+    compilePin(table->pins[ii].name, &table->descs[ii], output);
+  }
+  if (debugging()) Serial.print(output ? F("Compiled outputs: ") : F("Compiled inputs: ")), Serial.println(table->size);
+  return first + table->size + 1;
+}
 
-  for (int ii = 0, sz = setPins(Config.inputs, pins); ii < sz; ii++) {
-    if (pins[ii].name[0] == 'D') {
-      int pn = atoi(pins[ii].name + 1);
-      pinMode(pn, INPUT);
+// initPins compiles the input and output pins, which must be done
+// whenever they change, and initializes digital pins. On startup,
+// power pins are also initialized.
+void initPins(bool startup) {
+  int next = compilePins(Config.inputs, &Inputs, false, 0);
+  for (int ii = 0; ii < Inputs.size; ii++) {
+    if (Inputs.descs[ii].type == 'D') {
+      pinMode(Inputs.descs[ii].number, INPUT);
     }
   }
 
-  for (int ii = 0, sz = setPins(Config.outputs, pins); ii < sz; ii++) {
-    if (pins[ii].name[0] == 'D') {
-      int pn = atoi(pins[ii].name + 1);
-      pinMode(pn, OUTPUT);
+  compilePins(Config.outputs, &Outputs, true, next);
+  for (int ii = 0; ii < Outputs.size; ii++) {
+    if (Outputs.descs[ii].type == 'D') {
+      pinMode(Outputs.descs[ii].number, OUTPUT);
     }
   }
 
   if (startup) {
-    pinMode(ALARM_PIN, OUTPUT);
-    digitalWrite(ALARM_PIN, HIGH);
+    if (NetSenderTraits::alarms) {
+      pinMode(ALARM_PIN, OUTPUT);
+      digitalWrite(ALARM_PIN, HIGH);
+    }
     resetPowerPins();
   }
 }
 
-// readPin reads a pin value and returns it, or -1 upon error.
-// The data field will be set in the case of binary data, otherwise it will be NULL.
+// Aggregation utilities:
+
+// Aggregation represents the oversampling of a pin, with statistics
+// accumulated incrementally using Welford's algorithm.
+typedef struct {
+  Pin pin;               // Pin being sampled, i.e., A0 or an X pin.
+  int remaining;         // Samples remaining.
+  unsigned long next;    // Time of the next sample in microseconds.
+  unsigned long interval; // Sample interval in microseconds.
+  long count;            // Samples taken.
+  float mean;
+  float m2;              // Sum of squared differences from the mean.
+  int min;
+  int max;
+} Aggregation;
+
+static Aggregation Aggregate;
+
+// aggregating returns true if aggregation is configured.
+bool aggregating() {
+  return Config.vars[pvAggregateRate] > 0 && Config.vars[pvAggregateCount] > 0;
+}
+
+// startAggregate starts oversampling the pin given by AggregatePin,
+// which is 0 for A0, else the number of an X pin, AggregateCount times
+// at AggregateRate Hz, which is done by aggregateTask.
+void startAggregate() {
+  int pn = Config.vars[pvAggregatePin];
+  sprintf(Aggregate.pin.name, pn == 0 ? "A0" : "X%d", pn);
+  Aggregate.remaining = Config.vars[pvAggregateCount];
+  Aggregate.interval = 1000000UL / Config.vars[pvAggregateRate];
+  Aggregate.next = micros();
+  Aggregate.count = 0;
+  Aggregate.mean = 0;
+  Aggregate.m2 = 0;
+}
+
+// aggregateTask takes the next sample when it is due, updating the
+// statistics, until done. Negative (failed) samples are ignored.
+// NB: Samples are not printed in debug mode, which would affect timing.
+bool aggregateTask() {
+  if (Aggregate.remaining <= 0) {
+    return true;
+  }
+  if ((long)(micros() - Aggregate.next) < 0) {
+    return false;
+  }
+  Aggregate.next += Aggregate.interval;
+  Aggregate.remaining--;
+  int value = -1;
+  if (Aggregate.pin.name[0] == 'A') {
+    value = analogRead(0);
+  } else if (ExternalReader != NULL) {
+    value = (*ExternalReader)(&Aggregate.pin);
+  }
+  if (value >= 0) {
+    if (Aggregate.count == 0 || value < Aggregate.min) {
+      Aggregate.min = value;
+    }
+    if (Aggregate.count == 0 || value > Aggregate.max) {
+      Aggregate.max = value;
+    }
+    Aggregate.count++;
+    float delta = value - Aggregate.mean;
+    Aggregate.mean += delta / Aggregate.count;
+    Aggregate.m2 += delta * (value - Aggregate.mean);
+  }
+  if (Aggregate.remaining == 0 && debugging()) Serial.print(F("Aggregated samples: ")), Serial.println(Aggregate.count);
+  return Aggregate.remaining <= 0;
+}
+
+// aggregateValue returns an aggregate statistic, i.e., the minimum,
+// maximum, mean or (sample) standard deviation for index 0 to 3
+// respectively, or -1 if there are no samples.
+int aggregateValue(int index) {
+  if (Aggregate.count == 0) {
+    return -1;
+  }
+  switch (index) {
+  case 0:
+    return Aggregate.min;
+  case 1:
+    return Aggregate.max;
+  case 2:
+    return lround(Aggregate.mean);
+  default:
+    return Aggregate.count < 2 ? 0 : lround(sqrt(Aggregate.m2 / (Aggregate.count - 1)));
+  }
+}
+
+// Pin readers:
+
+// readAnalog reads an analog pin.
 // When SimulatedA0 is non-zero, this value is returned as the value for A0 one time only.
 // The following call to read A0 will therefore always return the actual value.
-int readPin(Pin * pin) {
-  int pn = atoi(pin->name + 1);
+int readAnalog(Pin * pin, int pn) {
+  if (pn == 0 && SimulatedA0 != 0) {
+    if (debugging()) Serial.println(F("Simulating A0"));
+    int value = SimulatedA0;
+    SimulatedA0 = 0;
+    return value;
+  }
+  return analogRead(pn);
+}
+
+// ChunkState represents the state of chunked binary reads this cycle.
+typedef struct {
+  bool pending;  // A capture is in progress with no chunk ready.
+  bool ready;    // A chunk is ready to send.
+  bool more;     // A chunk is ready and more chunks will follow.
+} ChunkState;
+
+static ChunkState Chunks;
+
+// readChunk reads the next chunk of a binary pin using the ChunkReader.
+int readChunk(Pin * pin) {
   pin->value = -1;
-  pin->data = NULL;
-  switch (pin->name[0]) {
-  case 'A':
-    if (pn == 0 && SimulatedA0 != 0) {
-      if (Debug) Serial.println(F("Simulating A0"));
-      pin->value = SimulatedA0;
-      SimulatedA0 = 0;
-    } else {
-      pin->value = analogRead(pn);
+  switch ((*ChunkReader)(pin, Rtc.chunk)) {
+  case binPending:
+    Chunks.pending = true;
+    return -1;
+  case binPartial:
+    Chunks.more = true;
+    // Fall through.
+  case binComplete:
+    Chunks.ready = true;
+    if (debugging()) Serial.print(F("Read chunk ")), Serial.println(Rtc.chunk);
+    return pin->value;
+  default:
+    return -1;
+  }
+}
+
+// sentChunks advances to the next chunk once a chunk has been sent,
+// or back to the first chunk, i.e., a new capture, once the final
+// chunk has been sent.
+void sentChunks() {
+  if (!Chunks.ready) {
+    return;
+  }
+  Rtc.chunk = Chunks.more ? Rtc.chunk + 1 : 0;
+  writeRtc();
+}
+
+// chunksPending returns true if chunked binary inputs are still being
+// captured, with nothing else to send or receive this cycle.
+bool chunksPending() {
+  if (!Chunks.pending || Chunks.ready || Outputs.size > 0) {
+    return false;
+  }
+  for (int ii = 0; ii < Inputs.size; ii++) {
+    if (Inputs.descs[ii].type != 'B' && strcmp(Inputs.pins[ii].name, "X10") != 0 && Inputs.pins[ii].value >= 0) {
+      return false;
     }
-    break;
+  }
+  return true;
+}
+
+// readBinary reads a binary pin using the ChunkReader, else the BinaryReader, if any.
+int readBinary(Pin * pin, int pn) {
+  if (ChunkReader != NULL) {
+    return readChunk(pin);
+  }
+  return BinaryReader != NULL ? (*BinaryReader)(pin) : -1;
+}
+
+// readDigital reads a digital pin.
+int readDigital(Pin * pin, int pn) {
+  return digitalRead(pn);
+}
+
+// readInternal reads an X pin maintained by NetSender.
+int readInternal(Pin * pin, int pn) {
+  return XPin[pn < xReadMin ? pn : pn - PHASE_PIN + xReadMin];
+}
+
+// readAggregate reads an aggregate statistic (see aggregateValue).
+int readAggregate(Pin * pin, int pn) {
+  return aggregateValue(pn - AGGREGATE_PIN);
+}
+
+// readExternal reads any other X pin using the ExternalReader, if any.
+int readExternal(Pin * pin, int pn) {
+  return ExternalReader != NULL ? (*ExternalReader)(pin) : -1;
+}
+
+// readInvalid handles pins of unknown type.
+int readInvalid(Pin * pin, int pn) {
+  return -1;
+}
+
+// pinReader returns the reader for a pin of the given type and number.
+PinFunc pinReader(char type, int pn) {
+  switch (type) {
+  case 'A':
+    return readAnalog;
   case 'B':
-    if (BinaryReader != NULL) {
-      pin->value = (*BinaryReader)(pin);
-    }
-    break;
+    return readBinary;
   case 'D':
-    pin->value = digitalRead(pn);
-    break;
+    return readDigital;
   case 'X':
-    if (pn >= 0 && pn < xMax) {
-      pin->value = XPin[pn];
-    } else if (ExternalReader != NULL) {
-      pin->value = (*ExternalReader)(pin);
+    if ((pn >= 0 && pn < xReadMin) || (pn >= PHASE_PIN && pn < PHASE_PIN + xMax - xReadMin)) {
+      return readInternal;
     }
-    break;
+    if (pn >= AGGREGATE_PIN && pn < AGGREGATE_PIN + 4) {
+      return readAggregate;
+    }
+    return readExternal;
   }
-  if (Debug) Serial.print(F("Read ")), Serial.print(pin->name), Serial.print(F("=")), Serial.println(pin->value);
+  return readInvalid;
+}
+
+// readPin reads a pin value, using its compiled descriptor, and returns it, or -1 upon error.
+// The data field will be set in the case of binary data, otherwise it will be NULL.
+int readPin(Pin * pin, const PinDesc * desc) {
+  pin->data = NULL;
+  pin->value = (*desc->func)(pin, desc->number);
+  if (debugging()) Serial.print(F("Read ")), Serial.print(pin->name), Serial.print(F("=")), Serial.println(pin->value);
   return pin->value;
 }
 
+// readPin reads a pin that has not been compiled, e.g., a one-off read.
+int readPin(Pin * pin) {
+  PinDesc desc;
+  compilePin(pin->name, &desc, false);
+  return readPin(pin, &desc);
+}
+
+// ReadState represents the state of reading input pins.
+typedef struct {
+  PinTable * table;
+  int next;   // Next pin to read.
+  unsigned long start; // Time reading started in microseconds.
+} ReadState;
+
+static ReadState Reads;
+
+// startReads starts reading the given pins, which is done by readTask.
+void startReads(PinTable * table) {
+  Reads.table = table;
+  Reads.next = 0;
+  Reads.start = micros();
+  Chunks.pending = Chunks.ready = Chunks.more = false;
+  XPin[xChunk] = Rtc.chunk;
+}
+
+// readTask reads the next pin, allowing other tasks to run between pins.
+// Aggregate pins are not read until aggregation is complete.
+bool readTask() {
+  PinTable * table = Reads.table;
+  if (Reads.next < table->size && table->descs[Reads.next].func == readAggregate && Aggregate.remaining > 0) {
+    return false;
+  }
+  if (Reads.next < table->size) {
+    readPin(&table->pins[Reads.next], &table->descs[Reads.next]);
+    if (++Reads.next == table->size) {
+      stopTimer(tRead, Reads.start);
+    }
+  }
+  return Reads.next >= table->size;
+}
+
+// Sampler utilities:
+
+// ReadingQueue is a single-producer, single-consumer ring buffer of
+// readings, written by the timer ISR and read from the main loop.
+// Only the ISR advances head and dropped, and only the main loop
+// advances tail and reported, so the number of readings dropped since
+// last reported is the difference of the two counts.
+typedef struct {
+  Reading readings[MAX_READINGS];
+  volatile int head;              // Next reading to write.
+  volatile int tail;              // Next reading to read.
+  volatile unsigned long dropped; // Readings dropped because the queue was full.
+  unsigned long reported;         // Dropped readings reported so far.
+} ReadingQueue;
+
+static ReadingQueue Readings;
+static int SampleRate = 0;
+
+// barrier stops the compiler reordering memory accesses across it,
+// which, since the ESP8266 has a single core, also orders them between
+// an ISR and the main loop.
+inline void barrier() {
+  __asm__ __volatile__("" ::: "memory");
+}
+
+// samplerISR takes a reading, unless the queue is full.
+void ICACHE_RAM_ATTR samplerISR() {
+  int head = Readings.head;
+  int next = (head + 1) % MAX_READINGS;
+  if (next == Readings.tail) {
+    Readings.dropped++;
+    return;
+  }
+  barrier(); // Read tail before overwriting the slot it frees.
+  Reading * reading = &Readings.readings[head];
+  reading->time = micros();
+  (*Sampler)(reading);
+  barrier(); // Complete the reading before publishing it.
+  Readings.head = next;
+}
+
+// analogOutputs returns true if any outputs are analog.
+bool analogOutputs() {
+  for (int ii = 0; ii < Outputs.size; ii++) {
+    if (Outputs.descs[ii].type == 'A') {
+      return true;
+    }
+  }
+  return false;
+}
+
+// setSampleRate starts, stops or changes the sample rate of the sampler.
+// Sampling is refused while there are analog outputs, since analogWrite
+// also uses timer1.
+void setSampleRate(int rate) {
+  if (rate > 0 && Sampler != NULL && analogOutputs()) {
+    if (debugging()) Serial.println(F("Error: Sampler disabled by analog outputs"));
+    rate = 0;
+  }
+  if (rate == SampleRate) {
+    return;
+  }
+  if (debugging()) Serial.print(F("Sample rate: ")), Serial.println(rate);
+  timer1_disable();
+  timer1_detachInterrupt();
+  SampleRate = rate;
+  if (rate <= 0 || Sampler == NULL) {
+    SampleRate = 0;
+    return;
+  }
+  timer1_attachInterrupt(samplerISR);
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
+  timer1_write(TIMER_FREQUENCY / rate);
+}
+
+// getReading dequeues the oldest reading, returning false if there are none.
+bool getReading(Reading * reading) {
+  int tail = Readings.tail;
+  if (tail == Readings.head) {
+    return false;
+  }
+  barrier(); // Read head before the reading it publishes.
+  *reading = Readings.readings[tail];
+  barrier(); // Copy the reading before freeing its slot.
+  Readings.tail = (tail + 1) % MAX_READINGS;
+  unsigned long dropped = Readings.dropped;
+  if (dropped != Readings.reported) {
+    if (debugging()) Serial.print(F("Warning: Dropped readings: ")), Serial.println(dropped - Readings.reported);
+    Readings.reported = dropped;
+  }
+  return true;
+}
+
 // setAlarmTimer sets/resets the alarm timer.
 void setAlarmTimer(bool alarm) {
   if (alarm) {
     if (AlarmedTime == 0) {
       AlarmedTime = millis();
-      if (Debug) Serial.println(F("Alarm timer ON"));
+      if (debugging()) Serial.println(F("Alarm timer ON"));
     } else {
-      if (Debug) Serial.println(F("Alarm timer continuing"));
+      if (debugging()) Serial.println(F("Alarm timer continuing"));
     }
   } else {
-    if (Debug) Serial.println(F("Alarm timer OFF"));
+    if (debugging()) Serial.println(F("Alarm timer OFF"));
     AlarmedTime = 0;
   }
 }
 
-// writePin writes a pin, with writes to the alarm pin stopping/starting the alarm timer.
-void writePin(Pin * pin) {
-  int pn = atoi(pin->name + 1);
-  PowerPin * pp;
-  if (Debug) Serial.print(F("Write ")), Serial.print(pin->name), Serial.print(F("=")), Serial.println(pin->value);
-  switch (pin->name[0]) {
-  case 'A':
-    analogWrite(pn, pin->value);
+// Pin writers:
+
+// writeAnalog writes an analog pin, unless the sampler is using timer1.
+// NB: The sampler is stopped next cycle (see setSampleRate).
+int writeAnalog(Pin * pin, int pn) {
+  if (SampleRate > 0) {
+    if (debugging()) Serial.print(F("Warning: Not writing ")), Serial.println(pin->name);
+    return -1;
+  }
+  analogWrite(pn, pin->value);
+  return pin->value;
+}
+
+// writeDigital writes a digital pin.
+int writeDigital(Pin * pin, int pn) {
+  digitalWrite(pn, pin->value);
+  return pin->value;
+}
+
+// writeInternal writes an X pin maintained by NetSender.
+int writeInternal(Pin * pin, int pn) {
+  switch (pn) {
+  case xA0:
+    SimulatedA0 = pin->value;
+    if (debugging()) Serial.print(F("Set simulated value for AO: ")), Serial.println(pin->value);
     break;
-  case 'D':
-    pp = getPowerPin(pn);
-    if (pp != NULL && pp->alarm) {
-      // Set/reset the alarm timer when writing the alarm pin.
-      setAlarmTimer(!pin->value);
+  case xPulseSuppress:
+    if (pin->value == 1) {
+      XPin[xPulseSuppress] = 1;
     }
-    digitalWrite(pn, pin->value);
     break;
+  }
+  return pin->value;
+}
+
+// writeInvalid handles pins that cannot be written.
+int writeInvalid(Pin * pin, int pn) {
+  if (debugging()) Serial.println(F("Warning: Invalid write"));
+  return -1;
+}
+
+// pinWriter returns the writer for a pin of the given type.
+PinFunc pinWriter(char type) {
+  switch (type) {
+  case 'A':
+    return writeAnalog;
+  case 'D':
+    return writeDigital;
   case 'X':
-    switch (pn) {
-    case xA0:
-      SimulatedA0 = pin->value;
-      if (Debug) Serial.print(F("Set simulated value for AO: ")), Serial.println(pin->value);
-      break;
-    case xPulseSuppress:
-      if (pin->value == 1) {
-        XPin[xPulseSuppress] = 1;
+    return writeInternal;
+  }
+  return writeInvalid;
+}
+
+// writePin writes a pin, using its compiled descriptor, with writes to
+// the alarm pin stopping/starting the alarm timer.
+void writePin(Pin * pin, const PinDesc * desc) {
+  if (debugging()) Serial.print(F("Write ")), Serial.print(pin->name), Serial.print(F("=")), Serial.println(pin->value);
+  if (desc->power != NULL && desc->power->alarm) {
+    // Set/reset the alarm timer when writing the alarm pin.
+    setAlarmTimer(!pin->value);
+  }
+  (*desc->func)(pin, desc->number);
+}
+
+// compilePin compiles a pin name into a descriptor, for reading or, when output is true, writing.
+void compilePin(const char * name, PinDesc * desc, bool output) {
+  desc->type = name[0];
+  desc->number = atoi(name + 1);
+  desc->func = output ? pinWriter(desc->type) : pinReader(desc->type, desc->number);
+  desc->power = desc->type == 'D' ? getPowerPin(desc->number) : NULL;
+}
+
+// PulseState represents the state of the pulse generator.
+typedef struct {
+  volatile bool active;    // True while pulsing.
+  bool suppress;           // True if pulses are suppressed.
+  bool cycle;              // True for the cycle's pulse groups, which are timed (see pause).
+  int pin;                 // Pin being pulsed.
+  int level;               // Level between pulses.
+  unsigned long timing[2]; // Active and inactive milliseconds of each pulse.
+  int pulses;              // Pulses per group.
+  int toggle;              // Next level change within the current group.
+  int groups;              // Remaining groups after the current one.
+  unsigned long gap;       // Milliseconds between groups.
+  unsigned long next;      // Time (millis) of the next level change.
+} PulseState;
+
+static PulseState Pulse;
+static Ticker PulseTicker;
+static unsigned long PulseLate = 0; // Milliseconds by which the cycle's pulses finished late.
+
+// pulseTimer makes pulse transitions as they fall due, then rearms the
+// timer for the next one. Transitions are scheduled relative to the
+// previous one so that timing errors do not accumulate.
+// NB: This runs from a timer callback, so pulses continue while the
+// main loop is busy, e.g., reading inputs or making HTTP requests.
+void pulseTimer() {
+  while (Pulse.active && (long)(millis() - Pulse.next) >= 0) {
+    if (Pulse.toggle < Pulse.pulses * 2) {
+      int ii = Pulse.toggle++;
+      if (!Pulse.suppress) {
+        digitalWrite(Pulse.pin, ii % 2 ? Pulse.level : !Pulse.level);
       }
-      break;
+      Pulse.next += Pulse.timing[ii % 2];
+    } else if (Pulse.groups > 0) {
+      Pulse.groups--;
+      Pulse.toggle = 0;
+      Pulse.next += Pulse.gap;
+    } else {
+      if (Pulse.cycle) {
+        PulseLate = millis() - Pulse.next;
+      }
+      Pulse.active = false;
     }
-    break;
-  default:
-    if (Debug) Serial.println(F("Warning: Invalid write"));
+  }
+  if (Pulse.active) {
+    long wait = (long)(Pulse.next - millis());
+    PulseTicker.once_ms(wait > 0 ? wait : 1, pulseTimer);
   }
 }
 
-// pulsePin generates pulses on the given pin, with each pulse having
-// the given width (seconds) and duty cycle (%), with the latter defaulting
-// to 50. When the dutyCycle is greater than 100, we subtract 100 and
-// pulse from HIGH to LOW instead of LOW to HIGH. In pulse suppression
-// true, the equivalent delay is produced without actual pulses being
-// generated.
-void pulsePin(int pin, int pulses, int width, int dutyCycle=50) {
+// startPulses starts generating groups of pulses on the given pin, with
+// each pulse having the given width (seconds) and duty cycle (%), with
+// the latter defaulting to 50, and gap milliseconds between groups.
+// When the dutyCycle is greater than 100, we subtract 100 and pulse
+// from HIGH to LOW instead of LOW to HIGH. In pulse suppression true,
+// the equivalent timing is produced without actual pulses being
+// generated. Pulses are generated by pulseTimer.
+// Returns the total pulse duration in milliseconds, or 0 if no pulses are generated.
+unsigned long startPulses(int pin, int pulses, int width, int dutyCycle=50, int groups=1, unsigned long gap=0) {
   int level = LOW;
-  if (pulses <= 0) return;
-  if (width <= 0 || pulses * width > Config.monPeriod) return;
-  if (dutyCycle < 0 || dutyCycle > 200 ) return;
-  if (Debug) {
-    if (XPin[xPulseSuppress]) {
+  if (pulses <= 0) return 0;
+  if (width <= 0 || pulses * width > Config.monPeriod) return 0;
+  if (dutyCycle < 0 || dutyCycle > 200 ) return 0;
+  Pulse.suppress = XPin[xPulseSuppress];
+  if (debugging()) {
+    if (Pulse.suppress) {
       Serial.print(F("Pulse suppressed: ")), Serial.print(pulses * width), Serial.println(F("s"));
     } else {
       Serial.print(F("Pulsing ")), Serial.print(pulses), Serial.print(F(",")), Serial.print(width), Serial.print(F(",")), Serial.println(dutyCycle);
@@ -414,39 +1415,346 @@ void pulsePin(int pin, int pulses, int width, int dutyCycle=50) {
   }
   width *= 1000; // in milliseconds
   int active = width * dutyCycle / 100;
-  int timing[2] = {active, width - active};
-  for (int ii = 0; ii < pulses * 2; ii++) {
-    if (!XPin[xPulseSuppress]) {
-      digitalWrite(pin, ii % 2 ? level : !level);
+  Pulse.pin = pin;
+  Pulse.level = level;
+  Pulse.timing[0] = active;
+  Pulse.timing[1] = width - active;
+  Pulse.pulses = pulses;
+  Pulse.toggle = 0;
+  Pulse.groups = groups - 1;
+  Pulse.gap = gap;
+  Pulse.next = millis();
+  Pulse.cycle = false;
+  Pulse.active = true;
+  pulseTimer();
+  return (unsigned long)groups * pulses * width + (groups - 1) * gap;
+}
+
+// pulseTask waits for pulses to finish, which pulseTimer generates.
+bool pulseTask() {
+  return !Pulse.active;
+}
+
+// pulsePin generates pulses on the given pin, blocking until done. Any
+// pulses already being generated are completed first.
+void pulsePin(int pin, int pulses, int width, int dutyCycle=50) {
+  while (!pulseTask()) {
+    idleDelay(1);
+  }
+  if (startPulses(pin, pulses, width, dutyCycle) > 0) {
+    while (!pulseTask()) {
+      idleDelay(1);
     }
-    delay(timing[ii % 2]);
   }
 }
 
-// cyclePin cycles a digital pin on and off, unless in pulse mode.
+// cyclePin cycles a digital pin on and off, unless in pulse mode, which
+// is never the case if pulses are compiled out (see NetSenderTraits).
+// Unforced cycles are also skipped after waking from deep sleep, which
+// would otherwise lengthen every cycle of a deep-sleeping device.
 void cyclePin(int pin, int cycles, bool force) {
-  if (!force && Config.vars[pvPulses] != 0) return;
+  if (!force && ((NetSenderTraits::pulses && Config.vars[pvPulses] != 0) || Woke)) return;
   pulsePin(pin, cycles, 1, 150);
 }
 
 // EEPROM utilities:
+// The configuration is stored in the flash sector reserved for EEPROM
+// emulation, as a journal of records, each of which updates a range of
+// the stored config. Records are appended to erased flash, so writing
+// the configuration does not erase the sector until the journal is
+// full, whereupon the journal is compacted into a single record. This
+// reduces sector erasures, and hence wear, by a factor of roughly
+// JOURNAL_SIZE divided by the typical record size. Each record has a
+// CRC, so that a torn write is detected, and discarded, when the
+// journal is replayed. The journal is as follows:
+//   Magic          (length 4) // JOURNAL_MAGIC
+//   Records, followed by erased flash (0xFF):
+//     Offset       (length 2) // Offset into the stored config, a multiple of 4.
+//     Size         (length 2) // Size of the data, a multiple of 4.
+//     Data         (length Size)
+//     CRC          (length 4) // CRC-32 of the offset, size and data.
+// NB: Flash is read and written in 4-byte words.
+//
+// The stored config is a version followed by length-prefixed fields,
+// so that fields can grow, or be added, without displacing others:
+//   Version        (length 2)
+//   Fields:
+//     Tag          (length 1) // configTag
+//     Size         (length 2)
+//     Data         (length Size)
+//   End            (length 1) // cfgEnd
+// Fields that are missing are zero, and unknown fields are ignored.
+// Integers are little endian, and strings are not null terminated.
+// Configs stored by version 173, the last release prior to the journal,
+// i.e., legacy configs, are images of LegacyConfig, which are migrated.
+
+// Stored config field tags.
+// NB: Never reuse or renumber tags.
+enum configTag {
+  cfgEnd       = 0,
+  cfgMonPeriod = 1,
+  cfgActPeriod = 2,
+  cfgBoot      = 3,
+  cfgWifi      = 4,
+  cfgDkey      = 5,
+  cfgInputs    = 6,
+  cfgOutputs   = 7,
+  cfgVars      = 8,
+  cfgFormat    = 9,
+  cfgVarSum    = 10,
+};
+
+static_assert(2 + 10 * 3 + 6 * 4 + WIFI_SIZE + DKEY_SIZE + 2 * IO_SIZE + MAX_VARS * 4 + 1 <= CONFIG_SIZE, "Configuration exceeds CONFIG_SIZE");
+
+// LegacyConfig is the fixed layout of configs stored in EEPROM by
+// version 173, which versions 170 to 173 share.
+typedef struct {
+  int32_t version;
+  int32_t monPeriod;
+  int32_t actPeriod;
+  int32_t boot;
+  char wifi[80];
+  char dkey[20];
+  char inputs[40];
+  char outputs[40];
+  int32_t vars[10];
+  char reserved[48];
+} LegacyConfig;
+
+extern "C" uint32_t _EEPROM_start;
+
+static uint32_t JournalAddress = 0; // Flash address of the journal.
+static uint32_t JournalEnd = 0;     // Offset of the end of the journal.
+static uint32_t Stored[CONFIG_SIZE / 4];  // Config as currently stored.
+static uint32_t Scratch[CONFIG_SIZE / 4 + 2]; // Config being read or written, plus a CRC and header.
+
+// journalRecord appends a record for the given range of the stored
+// config image to the journal, returning false if there is no room.
+bool journalRecord(uint32_t * image, uint16_t offset, uint16_t size) {
+  if (JournalEnd + 8 + size > JOURNAL_SIZE) {
+    return false;
+  }
+  uint32_t header = ((uint32_t)size << 16) | offset;
+  unsigned char * data = (unsigned char *)image + offset;
+  uint32_t crc = crc32(data, size, crc32((unsigned char *)&header, 4));
+  // NB: The CRC is written last, so a torn record is never valid.
+  ESP.flashWrite(JournalAddress + JournalEnd, &header, 4);
+  ESP.flashWrite(JournalAddress + JournalEnd + 4, (uint32_t *)data, size);
+  ESP.flashWrite(JournalAddress + JournalEnd + 4 + size, &crc, 4);
+  JournalEnd += 8 + size;
+  return true;
+}
+
+// compactJournal erases the journal and rewrites it as a single record
+// of the given size of the image.
+void compactJournal(uint32_t * image, uint16_t size) {
+  uint32_t magic = JOURNAL_MAGIC;
+  if (debugging()) Serial.println(F("Compacting config journal"));
+  ESP.flashEraseSector(JournalAddress / JOURNAL_SIZE);
+  ESP.flashWrite(JournalAddress, &magic, 4);
+  JournalEnd = 4;
+  journalRecord(image, 0, size);
+}
+
+// replayJournal replays journal records into an image of the given size,
+// returning false if a record is invalid, i.e., torn or corrupt, in which
+// case the image reflects the records preceding it.
+// Each record's data and CRC are read in a single block, together with
+// the header of the next record, so a compacted journal takes one read.
+bool replayJournal(uint32_t * image, size_t max) {
+  uint32_t header = 0xFFFFFFFF;
+  if (JournalEnd + 8 <= JOURNAL_SIZE) {
+    ESP.flashRead(JournalAddress + JournalEnd, &header, 4);
+  }
+  while (header != 0xFFFFFFFF) { // Erased flash marks the end of the journal.
+    uint16_t offset = header & 0xFFFF;
+    uint16_t size = header >> 16;
+    if (offset % 4 != 0 || size % 4 != 0 || offset + size > max || JournalEnd + 8 + size > JOURNAL_SIZE) {
+      return false;
+    }
+    bool more = JournalEnd + 8 + size + 8 <= JOURNAL_SIZE; // Room for another record.
+    unsigned char * data = (unsigned char *)Scratch;
+    ESP.flashRead(JournalAddress + JournalEnd + 4, Scratch, size + (more ? 8 : 4));
+    if (Scratch[size / 4] != crc32(data, size, crc32((unsigned char *)&header, 4))) {
+      return false;
+    }
+    memcpy((unsigned char *)image + offset, data, size);
+    JournalEnd += 8 + size;
+    header = more ? Scratch[size / 4 + 1] : 0xFFFFFFFF;
+  }
+  return true;
+}
+
+// putField appends a field to a stored config, returning the position following it.
+unsigned char * putField(unsigned char * cp, configTag tag, const void * data, uint16_t size) {
+  cp[0] = tag;
+  cp[1] = size & 0xFF;
+  cp[2] = size >> 8;
+  memcpy(cp + 3, data, size);
+  return cp + 3 + size;
+}
+
+// packConfig packs the config into the stored layout, zeroing the
+// remainder of the image, and returns the size used, rounded up to a
+// multiple of 4.
+uint16_t packConfig(Configuration * config, uint32_t * image) {
+  unsigned char * cp = (unsigned char *)image;
+  int32_t ints[] = {config->monPeriod, config->actPeriod, config->boot, config->format, config->varsum};
+  int32_t vars[MAX_VARS];
+  for (int ii = 0; ii < MAX_VARS; ii++) {
+    vars[ii] = config->vars[ii];
+  }
+  memset(cp, 0, CONFIG_SIZE);
+  cp[0] = config->version & 0xFF;
+  cp[1] = config->version >> 8;
+  cp += 2;
+  cp = putField(cp, cfgMonPeriod, &ints[0], 4);
+  cp = putField(cp, cfgActPeriod, &ints[1], 4);
+  cp = putField(cp, cfgBoot, &ints[2], 4);
+  cp = putField(cp, cfgWifi, config->wifi, strnlen(config->wifi, WIFI_SIZE - 1));
+  cp = putField(cp, cfgDkey, config->dkey, strnlen(config->dkey, DKEY_SIZE - 1));
+  cp = putField(cp, cfgInputs, config->inputs, strnlen(config->inputs, IO_SIZE - 1));
+  cp = putField(cp, cfgOutputs, config->outputs, strnlen(config->outputs, IO_SIZE - 1));
+  cp = putField(cp, cfgVars, vars, sizeof(vars));
+  cp = putField(cp, cfgFormat, &ints[3], 4);
+  cp = putField(cp, cfgVarSum, &ints[4], 4);
+  *cp++ = cfgEnd;
+  return (cp - (unsigned char *)image + 3) & ~3;
+}
+
+// getString copies a stored string field, truncating it if necessary.
+void getString(const unsigned char * data, uint16_t size, char * dst, size_t max) {
+  if (size >= max) {
+    size = max - 1;
+  }
+  memcpy(dst, data, size);
+  dst[size] = '\0';
+}
+
+// unpackConfig unpacks a stored config, returning false if it is malformed,
+// in which case fields from the malformed field onwards are zero.
+bool unpackConfig(uint32_t * image, Configuration * config) {
+  const unsigned char * cp = (const unsigned char *)image;
+  const unsigned char * end = cp + CONFIG_SIZE;
+  int32_t value;
+  memset((unsigned char *)config, 0, sizeof(Configuration));
+  config->version = cp[0] | cp[1] << 8;
+  for (cp += 2; cp < end && *cp != cfgEnd; ) {
+    if (cp + 3 > end || cp + 3 + (cp[1] | cp[2] << 8) > end) {
+      return false;
+    }
+    configTag tag = (configTag)cp[0];
+    uint16_t size = cp[1] | cp[2] << 8;
+    const unsigned char * data = cp + 3;
+    cp += 3 + size;
+    value = 0;
+    if (size == 4) {
+      memcpy(&value, data, 4);
+    }
+    switch (tag) {
+    case cfgMonPeriod:
+      config->monPeriod = value;
+      break;
+    case cfgActPeriod:
+      config->actPeriod = value;
+      break;
+    case cfgBoot:
+      config->boot = value;
+      break;
+    case cfgFormat:
+      config->format = value;
+      break;
+    case cfgVarSum:
+      config->varsum = value;
+      break;
+    case cfgWifi:
+      getString(data, size, config->wifi, WIFI_SIZE);
+      break;
+    case cfgDkey:
+      getString(data, size, config->dkey, DKEY_SIZE);
+      break;
+    case cfgInputs:
+      getString(data, size, config->inputs, IO_SIZE);
+      break;
+    case cfgOutputs:
+      getString(data, size, config->outputs, IO_SIZE);
+      break;
+    case cfgVars:
+      // Vars added since the config was stored are zero.
+      for (int ii = 0; ii < MAX_VARS && (ii + 1) * 4 <= size; ii++) {
+        memcpy(&value, data + ii * 4, 4);
+        config->vars[ii] = value;
+      }
+      break;
+    default:
+      break; // Ignore fields from later versions.
+    }
+  }
+  return true;
+}
+
+// migrateConfig migrates a legacy config, returning false if its layout is unknown.
+// Vars added since version 173 are zero and the wire format is text,
+// until renegotiated by the next config request.
+bool migrateConfig(LegacyConfig * legacy, Configuration * config) {
+  memset((unsigned char *)config, 0, sizeof(Configuration));
+  config->version = VERSION;
+  if (legacy->version < 170 || legacy->version > 173) {
+    return false;
+  }
+  config->monPeriod = legacy->monPeriod;
+  config->actPeriod = legacy->actPeriod;
+  config->boot = legacy->boot;
+  getString((unsigned char *)legacy->wifi, strnlen(legacy->wifi, sizeof(legacy->wifi)), config->wifi, WIFI_SIZE);
+  getString((unsigned char *)legacy->dkey, strnlen(legacy->dkey, sizeof(legacy->dkey)), config->dkey, DKEY_SIZE);
+  getString((unsigned char *)legacy->inputs, strnlen(legacy->inputs, sizeof(legacy->inputs)), config->inputs, IO_SIZE);
+  getString((unsigned char *)legacy->outputs, strnlen(legacy->outputs, sizeof(legacy->outputs)), config->outputs, IO_SIZE);
+  for (int ii = 0; ii < 10; ii++) {
+    config->vars[ii] = legacy->vars[ii];
+  }
+  config->format = wireText;
+  return true;
+}
 
 // readConfig reads the configuration from EEPROM.
+// A legacy config, i.e., one written prior to journaling, is migrated
+// and rewritten in the current layout. Configs of unknown layout are
+// cleared.
 void readConfig(Configuration* config) {
-  unsigned char *bytep = (unsigned char *)config;
-  EEPROM.begin(sizeof(Configuration));
-  for (int ii = 0; ii < sizeof(Configuration); ii++) {
-    unsigned char ch = EEPROM.read(ii);
-    if (ch == 255) {
-      *bytep++ = '\0';
+  uint32_t magic;
+  JournalAddress = (uintptr_t)&_EEPROM_start - 0x40200000;
+  JournalEnd = 4;
+  memset((unsigned char *)Stored, 0, CONFIG_SIZE);
+  ESP.flashRead(JournalAddress, &magic, 4);
+  if (magic == JOURNAL_MAGIC) {
+    if (!replayJournal(Stored, CONFIG_SIZE)) {
+      if (debugging()) Serial.println(F("Warning: Discarding torn config record"));
+      compactJournal(Stored, CONFIG_SIZE);
+    }
+    if (!unpackConfig(Stored, config)) {
+      if (debugging()) Serial.println(F("Warning: Malformed config"));
+    }
+    if (config->version != VERSION) {
+      if (debugging()) Serial.print(F("Upgrading config with version ")), Serial.println(config->version);
+      config->version = VERSION;
+      writeConfig(config);
+    }
+  } else {
+    // The legacy format is just the config, with erased bytes read as 0.
+    LegacyConfig legacy;
+    ESP.flashRead(JournalAddress, (uint32_t *)&legacy, sizeof(LegacyConfig));
+    unsigned char *bytep = (unsigned char *)&legacy;
+    for (size_t ii = 0; ii < sizeof(LegacyConfig); ii++, bytep++) {
+      if (*bytep == 255) {
+        *bytep = '\0';
+      }
+    }
+    if (migrateConfig(&legacy, config)) {
+      if (debugging()) Serial.print(F("Migrating config with version ")), Serial.println(legacy.version);
     } else {
-      *bytep++ = ch;
+      if (debugging()) Serial.print(F("Clearing config with version ")), Serial.println(legacy.version);
     }
-  }
-  if (config->version/10 != VERSION/10) {
-    if (Debug) Serial.print(F("Clearing config with version ")), Serial.println(config->version);
-    memset((unsigned char *)config, 0, sizeof(Configuration));
-    config->version = VERSION;
+    compactJournal(Stored, packConfig(config, Stored));
   }
   if (config->monPeriod == 0) {
     config->monPeriod = RETRY_PERIOD;
@@ -465,28 +1773,464 @@ void printConfig() {
   Serial.print(F("actPeriod: ")), Serial.println(Config.actPeriod);
   Serial.print(F("inputs: ")), Serial.println(Config.inputs);
   Serial.print(F("outputs: ")), Serial.println(Config.outputs);
+  Serial.print(F("format: ")), Serial.println(Config.format);
+  Serial.print(F("varsum: ")), Serial.println(Config.varsum);
   for (int ii = 0; ii < MAX_VARS; ii++) {
     Serial.print(PvNames[ii]), Serial.print(F("=")), Serial.println(Config.vars[ii]);
   }
   Serial.flush();
 }
 
-// writeConfig writes the configuration to EEPROM.
+// writeConfig writes the configuration to EEPROM, appending records
+// for only those words of the stored config that differ from those
+// currently stored, and compacting the journal if it is full.
+// NB: Runs of changed words separated by 2 or fewer unchanged words are
+// merged, since a record has 8 bytes of overhead.
 void writeConfig(Configuration* config) {
-  unsigned char *bytep = (unsigned char *)config;
-  if (Debug) Serial.println(F("Writing config"));
-  EEPROM.begin(sizeof(Configuration));
-  for (int ii = 0; ii < sizeof(Configuration); ii++) {
-    EEPROM.write(ii, *bytep++);
+  uint32_t * words = Scratch;
+  uint16_t size = packConfig(config, words);
+  const int nn = CONFIG_SIZE / 4;
+  unsigned long start = micros();
+  if (debugging()) Serial.println(F("Writing config"));
+  for (int ii = 0; ii < nn; ) {
+    if (words[ii] == Stored[ii]) {
+      ii++;
+      continue;
+    }
+    int start = ii, finish = ii + 1; // Run of changed words.
+    for (ii = finish; ii < nn && ii - finish <= 2; ii++) {
+      if (words[ii] != Stored[ii]) {
+        finish = ii + 1;
+      }
+    }
+    ii = finish;
+    if (!journalRecord(words, start * 4, (finish - start) * 4)) {
+      compactJournal(words, size);
+      break;
+    }
+  }
+  memcpy((unsigned char *)Stored, (unsigned char *)words, CONFIG_SIZE);
+  stopTimer(tCommit, start);
+  if (debugging()) Serial.print(F("Wrote config, journal size: ")), Serial.println(JournalEnd), printConfig();
+}
+
+// RTC memory utilities:
+
+// rtcChecksum returns the checksum of the RTC data, excluding the checksum itself.
+uint32_t rtcChecksum() {
+  return crc32((unsigned char *)&Rtc + sizeof(Rtc.crc), sizeof(RtcData) - sizeof(Rtc.crc));
+}
+
+// readRtc reads RTC data from RTC user memory, clearing it if the checksum is invalid, e.g., after power loss.
+void readRtc() {
+  ESP.rtcUserMemoryRead(0, (uint32_t *)&Rtc, sizeof(RtcData));
+  if (Rtc.crc != rtcChecksum()) {
+    if (debugging()) Serial.println(F("Clearing RTC data"));
+    memset((unsigned char *)&Rtc, 0, sizeof(RtcData));
+  }
+}
+
+// writeRtc writes RTC data to RTC user memory.
+void writeRtc() {
+  Rtc.crc = rtcChecksum();
+  ESP.rtcUserMemoryWrite(0, (uint32_t *)&Rtc, sizeof(RtcData));
+}
+
+// clockTime returns the seconds elapsed since the RTC data was last
+// cleared. Unlike millis, it includes time spent deep sleeping.
+unsigned long clockTime() {
+  return Rtc.clock + (Rtc.residue + millis())/1000;
+}
+
+// clockMillis returns clockTime in milliseconds, modulo 2^32.
+uint32_t clockMillis() {
+  return Rtc.clock * 1000 + Rtc.residue + millis();
+}
+
+// saveClock saves the clock in RTC data, advanced by the given milliseconds, e.g., for deep sleep.
+void saveClock(unsigned long ms) {
+  unsigned long total = Rtc.residue + millis() + ms;
+  Rtc.clock += total/1000;
+  Rtc.residue = total % 1000;
+  writeRtc();
+}
+
+// deepSleep deep sleeps for the given number of milliseconds, saving the clock first.
+void deepSleep(long ms) {
+  saveClock(ms);
+  ESP.deepSleep(ms * 1000L);
+}
+
+// Scheduling utilities:
+// Cycles are scheduled against server time, when known, so that they
+// do not wander due to lag or the drift of the RTC while deep sleeping.
+// Each device cycles at a phase offset within the monitor period, so
+// that the devices of a fleet do not all poll at once.
+
+// parseDate parses an HTTP date, e.g., "Tue, 14 Oct 2026 08:49:37 GMT",
+// returning Unix time, or 0 if the date is malformed.
+unsigned long parseDate(const char * date) {
+  const char * months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  const char * cp = strchr(date, ',');
+  if (cp == NULL) {
+    return 0;
+  }
+  char * end;
+  long day = strtol(cp + 1, &end, 10);
+  while (*end == ' ') {
+    end++;
+  }
+  int month = 0;
+  while (month < 12 && strncmp(months + month * 3, end, 3) != 0) {
+    month++;
+  }
+  if (month == 12) {
+    return 0;
+  }
+  long year = strtol(end + 3, &end, 10);
+  long hour = strtol(end, &end, 10);
+  long minute = *end == ':' ? strtol(end + 1, &end, 10) : -1;
+  long second = *end == ':' ? strtol(end + 1, &end, 10) : -1;
+  if (year < 1970 || day < 1 || day > 31 || hour < 0 || minute < 0 || second < 0) {
+    return 0;
+  }
+  // Days since the epoch, using a calendar starting in March, so leap days fall last.
+  month++;
+  if (month <= 2) {
+    year--;
+  }
+  long era = year / 400;
+  long yoe = year - era * 400;
+  long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+  return days * 86400UL + hour * 3600 + minute * 60 + second;
+}
+
+// syncClock records server time, updating the drift estimate, which is
+// a moving average, once SYNC_PERIOD seconds have elapsed since the
+// last sync. Until then, the last sync is kept as is, since one-second
+// resolution makes short intervals useless for estimating drift.
+void syncClock(unsigned long time) {
+  ClockSync * sync = &Rtc.sync;
+  uint32_t now = clockMillis();
+  long elapsed = now - sync->clock;
+  if (sync->time != 0 && elapsed >= 0 && elapsed < SYNC_PERIOD * 1000L && time >= sync->time) {
+    return;
+  }
+  if (sync->time != 0 && elapsed > 0 && elapsed < SYNC_EXPIRY * 1000L && time >= sync->time) {
+    long long gained = (long long)(time - sync->time) * 1000 - elapsed;
+    long drift = gained * 1000000 / elapsed;
+    if (drift > MAX_DRIFT) {
+      drift = MAX_DRIFT;
+    } else if (drift < -MAX_DRIFT) {
+      drift = -MAX_DRIFT;
+    }
+    sync->drift = (sync->drift * 3 + drift) / 4;
+    if (debugging()) Serial.print(F("Clock drift: ")), Serial.print(sync->drift), Serial.println(F("ppm"));
+  }
+  sync->time = time;
+  sync->clock = now;
+  writeRtc();
+}
+
+// phaseOffset returns the offset in seconds of this device's cycles
+// within the given period, which is the Phase var, if non-zero, else
+// derived from our MAC address.
+long phaseOffset(long period) {
+  if (Config.vars[pvPhase] > 0) {
+    return Config.vars[pvPhase] % period;
   }
-  EEPROM.commit();
-  if (Debug) Serial.println(F("Wrote config")), printConfig();
+  return crc32(Mac, 6) % period;
+}
+
+// scheduledDelay returns the milliseconds until the start of the next
+// cycle, i.e., the next multiple of period seconds of server time
+// after the phase offset, corrected for drift, or -1 if we have not
+// synced with the server recently.
+long scheduledDelay(long period) {
+  ClockSync * sync = &Rtc.sync;
+  long elapsed = clockMillis() - sync->clock;
+  if (sync->time == 0 || period <= 0 || elapsed < 0 || elapsed > SYNC_EXPIRY * 1000L) {
+    return -1;
+  }
+  long long now = (long long)sync->time * 1000 + elapsed + (long long)elapsed * sync->drift / 1000000;
+  long long ms = period * 1000LL;
+  long long due = ms - ((now - phaseOffset(period) * 1000LL) % ms + ms) % ms;
+  return due * 1000000 / (1000000 + sync->drift);
+}
+
+// Sample buffering utilities:
+
+// scalarInputs returns true if there are inputs, none of which are
+// binary, and no more than SAMPLE_PINS, i.e., inputs that a Sample holds.
+bool scalarInputs() {
+  return Inputs.size > 0 && Inputs.size <= SAMPLE_PINS && strchr(Config.inputs, 'B') == NULL;
+}
+
+// batching returns true if batched polling is enabled, which requires
+// a batch period of more than one cycle and scalar inputs only.
+bool batching() {
+  return Config.vars[pvBatchPeriod] > 1 && scalarInputs();
+}
+
+// clearSamples empties the sample buffer and forgets the input values last sent.
+void clearSamples() {
+  Rtc.buffer.cycles = 0;
+  Rtc.buffer.head = 0;
+  Rtc.buffer.count = 0;
+  Rtc.sent.time = 0;
+  writeRtc();
+}
+
+// bufferSample appends input values to the sample buffer, overwriting
+// the oldest sample if full. It returns true if the sample can be held
+// over for a later batched poll, or false if it is time to poll, i.e.,
+// after BatchPeriod cycles or when BatchSize samples are buffered.
+bool bufferSample(Pin * inputs, int sz) {
+  SampleBuffer * buf = &Rtc.buffer;
+  int size = Config.vars[pvBatchSize];
+  if (size <= 0 || size > MAX_SAMPLES) {
+    size = MAX_SAMPLES;
+  }
+  if (buf->count == MAX_SAMPLES) {
+    if (debugging()) Serial.println(F("Warning: Sample buffer full, discarding oldest sample"));
+    buf->head = (buf->head + 1) % MAX_SAMPLES;
+    buf->count--;
+  }
+  Sample * sample = &buf->samples[(buf->head + buf->count) % MAX_SAMPLES];
+  buf->count++;
+  sample->time = clockTime();
+  for (int ii = 0; ii < SAMPLE_PINS; ii++) {
+    sample->values[ii] = ii < sz ? inputs[ii].value : -1;
+  }
+  buf->cycles++;
+  writeRtc();
+  if (debugging()) Serial.print(F("Buffered samples: ")), Serial.println(buf->count);
+  return buf->cycles < Config.vars[pvBatchPeriod] && buf->count < size;
+}
+
+// Deadband utilities:
+
+// suppressing returns true if deadband suppression is enabled, which
+// requires a silence period, scalar inputs only and no batching.
+bool suppressing() {
+  return Config.vars[pvSilencePeriod] > 0 && scalarInputs() && !batching();
+}
+
+// changedSample returns true if any input value has changed beyond the
+// deadband since the values were last sent, or if SilencePeriod seconds
+// have elapsed since then. Digital pins change when their value does,
+// regardless of the deadband. Negative (missing) values are ignored.
+bool changedSample(Pin * inputs, int sz) {
+  Sample * sent = &Rtc.sent;
+  if (sent->time == 0 || clockTime() - sent->time >= (unsigned long)Config.vars[pvSilencePeriod]) {
+    return true;
+  }
+  for (int ii = 0; ii < sz; ii++) {
+    if (inputs[ii].value < 0) {
+      continue;
+    }
+    int band = inputs[ii].name[0] == 'D' ? 0 : Config.vars[pvDeadband];
+    if (abs(inputs[ii].value - sent->values[ii]) > band) {
+      if (debugging()) Serial.print(F("Changed ")), Serial.println(inputs[ii].name);
+      return true;
+    }
+  }
+  return false;
+}
+
+// sentSample records input values that have been sent.
+void sentSample(Pin * inputs) {
+  Sample * sent = &Rtc.sent;
+  sent->time = clockTime();
+  int ii = 0;
+  for (; ii < SAMPLE_PINS && inputs[ii].name[0] != '\0'; ii++) {
+    sent->values[ii] = inputs[ii].value;
+  }
+  for (; ii < SAMPLE_PINS; ii++) {
+    sent->values[ii] = -1;
+  }
+  writeRtc();
+}
+
+// batchBody formats samples as a JSON array for a batched poll,
+// oldest first, where "ag" is the age of the sample in seconds, e.g.,
+//   [{"ag":60,"A0":512,"X50":2931},{"ag":0,"A0":498,"X50":2930}]
+// Samples are taken from a ring of the given capacity, starting at head.
+// Negative values are omitted, except for X10.
+// NB: body must be at least BATCH_SIZE bytes and count at most MAX_BATCH.
+void batchBody(char * body, Pin * inputs, Sample * samples, int head, int count, int capacity) {
+  unsigned long now = clockTime();
+  char * cp = body;
+  *cp++ = '[';
+  for (int ii = 0; ii < count; ii++) {
+    Sample * sample = &samples[(head + ii) % capacity];
+    if (ii > 0) {
+      *cp++ = ',';
+    }
+    cp += sprintf(cp, "{\"ag\":%d", (int)(now - sample->time));
+    for (int jj = 0; jj < SAMPLE_PINS && inputs[jj].name[0] != '\0'; jj++) {
+      if (sample->values[jj] < 0 && strcmp(inputs[jj].name, "X10") != 0) {
+        continue;
+      }
+      cp += sprintf(cp, ",\"%s\":%d", inputs[jj].name, sample->values[jj]);
+    }
+    *cp++ = '}';
+  }
+  *cp++ = ']';
+  *cp = '\0';
+}
+
+// Store-and-forward utilities:
+// Samples which could not be sent are appended to a queue in flash,
+// which is sent in batches once the network is available again. The
+// queue is bounded by rotating the queue file to QUEUE_OLD_FILE when
+// it reaches QUEUE_SIZE, discarding the unsent samples of any older file.
+// Rtc.queued is the offset of the next unsent sample in the file being
+// sent, i.e., QUEUE_OLD_FILE if it exists, else QUEUE_FILE.
+// NB: Samples are resent if power is lost while sending QUEUE_OLD_FILE.
+
+// queueFile returns the name of the queue file to be sent next, or NULL if the queue is empty.
+const char * queueFile() {
+  if (LittleFS.exists(QUEUE_OLD_FILE)) {
+    return QUEUE_OLD_FILE;
+  }
+  if (LittleFS.exists(QUEUE_FILE)) {
+    return QUEUE_FILE;
+  }
+  return NULL;
+}
+
+// startQueue mounts the file system for the store-and-forward queue.
+// If the clock has been reset by a loss of power, it is advanced to the
+// time of the last queued sample, so that ages remain in order, albeit
+// underestimated.
+void startQueue() {
+  Queueing = LittleFS.begin();
+  if (!Queueing) {
+    Serial.println(F("Warning: Store-and-forward queue not available"));
+    return;
+  }
+  File file = LittleFS.open(QUEUE_FILE, "r");
+  if (file && file.size() >= sizeof(Sample)) {
+    Sample last;
+    file.seek(file.size() - file.size() % sizeof(Sample) - sizeof(Sample));
+    file.read((uint8_t *)&last, sizeof(Sample));
+    if (last.time > clockTime()) {
+      Rtc.clock = last.time;
+    }
+  }
+  file.close();
+}
+
+// queueSample appends a sample to the store-and-forward queue.
+void queueSample(Sample * sample) {
+  File file = LittleFS.open(QUEUE_FILE, "a");
+  if (file && file.size() >= QUEUE_SIZE) {
+    file.close();
+    if (LittleFS.exists(QUEUE_OLD_FILE)) {
+      // The older file is being sent, so discard its unsent samples, then
+      // send the current file, none of which has been sent, from the start.
+      File old = LittleFS.open(QUEUE_OLD_FILE, "r");
+      long discarded = old ? ((long)old.size() - (long)Rtc.queued) / (long)sizeof(Sample) : 0;
+      old.close();
+      if (discarded > 0 && debugging()) Serial.print(F("Warning: Queue full, discarded samples: ")), Serial.println(discarded);
+      LittleFS.remove(QUEUE_OLD_FILE);
+      Rtc.queued = 0;
+    }
+    // Otherwise the current file is being sent, so its offset carries over.
+    LittleFS.rename(QUEUE_FILE, QUEUE_OLD_FILE);
+    writeRtc();
+    file = LittleFS.open(QUEUE_FILE, "a");
+  }
+  if (!file || file.write((const uint8_t *)sample, sizeof(Sample)) != sizeof(Sample)) {
+    if (debugging()) Serial.println(F("Warning: Failed to queue sample"));
+  }
+  file.close();
+}
+
+// queueSamples queues samples that could not be sent, i.e., the sample
+// buffer when batching, which includes the latest sample, else the
+// given input values. Binary inputs are not queued.
+void queueSamples(Pin * inputs, int sz) {
+  if (!Queueing || !scalarInputs()) {
+    return;
+  }
+  if (batching()) {
+    SampleBuffer * buf = &Rtc.buffer;
+    for (int ii = 0; ii < buf->count; ii++) {
+      queueSample(&buf->samples[(buf->head + ii) % MAX_SAMPLES]);
+    }
+    clearSamples();
+    return;
+  }
+  Sample sample;
+  sample.time = clockTime();
+  for (int ii = 0; ii < SAMPLE_PINS; ii++) {
+    sample.values[ii] = ii < sz ? inputs[ii].value : -1;
+  }
+  queueSample(&sample);
+  if (debugging()) Serial.println(F("Queued sample"));
+}
+
+// readQueue reads up to MAX_BATCH unsent samples into Backlog, returning the number read.
+int readQueue() {
+  const char * name = queueFile();
+  if (name == NULL) {
+    return 0;
+  }
+  File file = LittleFS.open(name, "r");
+  int count = 0;
+  if (file && file.seek(Rtc.queued)) {
+    count = file.read((uint8_t *)Backlog, sizeof(Backlog)) / sizeof(Sample);
+  }
+  file.close();
+  if (count == 0) {
+    // Nothing left, or the file is unreadable, so discard it.
+    LittleFS.remove(name);
+    Rtc.queued = 0;
+    writeRtc();
+    return strcmp(name, QUEUE_OLD_FILE) == 0 ? readQueue() : 0;
+  }
+  return count;
+}
+
+// sentQueue records that count samples have been sent from the queue.
+void sentQueue(int count) {
+  Rtc.queued += count * sizeof(Sample);
+  writeRtc();
+}
+
+// clearQueue discards all queued samples.
+void clearQueue() {
+  if (!Queueing) {
+    return;
+  }
+  LittleFS.remove(QUEUE_OLD_FILE);
+  LittleFS.remove(QUEUE_FILE);
+  Rtc.queued = 0;
+  writeRtc();
+}
+
+// alarmTask clears a temporary alarm after AlarmPeriod seconds.
+bool alarmTask() {
+  if (TemporaryAlarmTime == 0) {
+    return true;
+  }
+  if (elapsedMillis(TemporaryAlarmTime) < Config.vars[pvAlarmPeriod] * 1000UL) {
+    return false;
+  }
+  if (debugging()) Serial.println(F("Cleared temporary alarm"));
+  digitalWrite(ALARM_PIN, HIGH);
+  XPin[xAlarmed] = false;
+  TemporaryAlarmTime = 0;
+  return true;
 }
 
 // writeAlarm writes the alarm pin.
 // The continuous param controls the alarm duration:
 //   If true, the alarm duration is continuous (until canceled by an auto restart).
-//   If false, the alarm is for AlarmPeriod seconds.
+//   If false, the alarm is for AlarmPeriod seconds, during which other tasks continue.
 //   For a continuous alarms, power pins are reset,
 //   but restoring power is left up to the normal actuation cycle.
 //
@@ -498,17 +2242,21 @@ void writeConfig(Configuration* config) {
 //   XPin[xAlarms], the alarm count, is incremented each time the alarm is set.
 //   AlarmedTime is set to the alarm start time.
 void writeAlarm(bool alarm, bool continuous) {
+  if (!NetSenderTraits::alarms) {
+    return;
+  }
   if (!alarm) {
-    if (Debug) Serial.println(F("Cleared alarm"));
+    if (debugging()) Serial.println(F("Cleared alarm"));
     digitalWrite(ALARM_PIN, HIGH);
     XPin[xAlarmed] = false;
     AlarmedTime = 0;
+    TemporaryAlarmTime = 0;
     return;
   }
   if (Config.vars[pvAlarmNetwork] == 0 && Config.vars[pvAlarmVoltage] == 0) {
     return;
   }
-  if (Debug) Serial.println(F("Set alarm"));
+  if (debugging()) Serial.println(F("Set alarm"));
   digitalWrite(ALARM_PIN, LOW);
   XPin[xAlarms]++;
 
@@ -522,32 +2270,30 @@ void writeAlarm(bool alarm, bool continuous) {
     return;
   }
 
-  // Alarm is temporary.
-  if (Debug) Serial.print(F("Alarming for ")), Serial.print(Config.vars[pvAlarmPeriod]), Serial.println(F("s"));
-  delay(Config.vars[pvAlarmPeriod] * 1000);
-  if (Debug) Serial.println(F("Cleared temporary alarm"));
-  digitalWrite(ALARM_PIN, HIGH);
-  XPin[xAlarmed] = false;
+  // Alarm is temporary, and is cleared by alarmTask.
+  if (debugging()) Serial.print(F("Alarming for ")), Serial.print(Config.vars[pvAlarmPeriod]), Serial.println(F("s"));
+  TemporaryAlarmTime = millis();
+  addTask(alarmTask, true);
 }
 
 // restart restarts the ESP8266, saving the reason, and raising an
 // alarm before restarting when alarm is true.
 // NB: For restart purposes, bootClear is treated like bootAlarm.
 void restart(bootReason reason, bool alarm) {
-  if (Debug) Serial.print(F("Restarting (")), Serial.print(reason), Serial.print(F(",")), Serial.print(alarm), Serial.println(F(")"));
+  if (debugging()) Serial.print(F("Restarting (")), Serial.print(reason), Serial.print(F(",")), Serial.print(alarm), Serial.println(F(")"));
   if (Config.boot == bootClear) {
     Config.boot = bootAlarm;
   }
   if (reason != Config.boot) {
-    if (Debug) Serial.print(F("Writing boot reason: ")), Serial.println(reason);
+    if (debugging()) Serial.print(F("Writing boot reason: ")), Serial.println(reason);
     Config.boot = reason;
     writeConfig(&Config);
   }
   if (alarm) {
-    writeAlarm(true, true);
-    delay(2000);
+    writeAlarm(true, true); // NB: The alarm is held while the LED cycles.
   }
   cyclePin(LED_PIN, 6, true);
+  saveClock(0);
   ESP.restart();
 }
 
@@ -568,7 +2314,7 @@ void wifiOff() {
   bool stopped = false;
   for (int attempts = 0; !stopped && attempts < WIFI_ATTEMPTS; attempts++) {
     stopped = (wifi_station_get_connect_status() == DHCP_STOPPED);
-    delay(WIFI_DELAY);
+    idleDelay(WIFI_DELAY);
   }
   if (!stopped) {
     Serial.println("Warning: DHCP not stopping.");
@@ -590,38 +2336,75 @@ bool wifiControl(bool on) {
     if (WiFi.status() == WL_CONNECTED) {
       return true; // Nothing to do.
     }
+    unsigned long start = micros();
     wifiOn();
-    delay(WIFI_DELAY);
+    idleDelay(WIFI_DELAY);
     if (!WiFi.mode(WIFI_STA)) {
       Serial.println(F("Warning: WiFi not starting"));
       return false;
     }
-    if (Debug) Serial.println(F("WiFi on"));
+    stopTimer(tWifiOn, start);
+    if (debugging()) Serial.println(F("WiFi on"));
   } else {
+    httpClose();
     if (!WiFi.mode(WIFI_STA)) {
       return true;
     }
     if (WiFi.status() == WL_CONNECTED) {
       WiFi.disconnect();
-      delay(WIFI_DELAY);
+      idleDelay(WIFI_DELAY);
     }
     for (int attempts = 0; WiFi.status() == WL_CONNECTED && attempts < WIFI_ATTEMPTS; attempts++) {
-      delay(WIFI_DELAY);
+      idleDelay(WIFI_DELAY);
     }
     if (WiFi.status() == WL_CONNECTED) {
       Serial.println(F("Warning: WiFi not disconnecting"));
       restart(bootWiFi, true);
     }
     wifiOff();
-    delay(WIFI_DELAY);
-    if (Debug) Serial.println(F("WiFi off"));
+    idleDelay(WIFI_DELAY);
+    if (debugging()) Serial.println(F("WiFi off"));
+  }
+  return true;
+}
+
+// WiFi association states.
+enum wifiState {
+  wifiIdle,       // Not yet started.
+  wifiResuming,   // Reconnecting to the configured hotspot using cached settings.
+  wifiConnecting, // Associating with the configured hotspot.
+  wifiFallback,   // Associating with the default hotspot.
+  wifiConnected,  // Connected.
+  wifiFailed,     // Failed to connect.
+};
+
+static wifiState WifiState = wifiIdle;
+static unsigned long WifiTime = 0; // Time association started.
+static unsigned long AssociateStart = 0; // Time association started in microseconds.
+static unsigned long DhcpStart = 0;      // Time association completed in microseconds, or 0.
+static WiFiEventHandler AssociatedHandler;
+static WiFiEventHandler AddressedHandler;
+
+// onAssociated and onAddressed are WiFi event handlers which time
+// association and obtaining an IP address respectively. Resuming with
+// cached settings uses a static IP address, so the latter is then short.
+void onAssociated(const WiFiEventStationModeConnected& event) {
+  stopTimer(tAssociate, AssociateStart);
+  DhcpStart = micros();
+}
+
+void onAddressed(const WiFiEventStationModeGotIP& event) {
+  if (DhcpStart != 0) {
+    stopTimer(tDhcp, DhcpStart);
+    DhcpStart = 0;
   }
-  return true;
 }
 
-// wifiConnect attempt to connects to the supplied WiFi network.
+// wifiStart starts associating with the supplied WiFi network using
+// DHCP, returning false if there is nothing to do, i.e., no network is
+// supplied or we're already connected to it.
 // wifi is network info as CSV "ssid,key" (ssid must not contain a comma!)
-bool wifiConnect(const char * wifi) {
+bool wifiStart(const char * wifi) {
   // NB: only works for WPA/WPA2 network
   char ssid[WIFI_SIZE], *key;
   if (wifi[0] == '\0') {
@@ -636,178 +2419,833 @@ bool wifiConnect(const char * wifi) {
   }
   if (WiFi.status() == WL_CONNECTED) {
     if (strcmp(WiFi.SSID().c_str(), ssid) == 0) {
-      return true;
+      return false;
     }
     WiFi.disconnect();
   }
 
-  if (Debug) Serial.print(F("Requesting DHCP from ")), Serial.println(wifi);
+  if (debugging()) Serial.print(F("Requesting DHCP from ")), Serial.println(wifi);
+  // Revert to DHCP, in case static settings remain from a resumed connection.
+  WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
   WiFi.begin(ssid, key);
-  delay(WIFI_DELAY);
- 
-  // WiFi.waitForConnectResult can end up in an infinite loop, so don't use it!
-  // NB: connecting can take several seconds, so ensure WIFI_ATTEMPTS x WIFI_DELAY is at least 5000ms.
-  for (int attempts = 0; WiFi.status() != WL_CONNECTED && attempts < WIFI_ATTEMPTS; attempts++) {
-    delay(WIFI_DELAY);
-  }
-  if (WiFi.status() != WL_CONNECTED) {
-    if (Debug) Serial.println(F("Failed to connect to WiFi"));
+  WifiTime = millis();
+  AssociateStart = micros();
+  DhcpStart = 0;
+  return true;
+}
+
+// wifiChecksum returns the checksum of WiFi credentials, which is never 0.
+uint32_t wifiChecksum(const char * wifi) {
+  uint32_t crc = crc32((const unsigned char *)wifi, strlen(wifi));
+  return crc == 0 ? 1 : crc;
+}
+
+// wifiResume starts reconnecting to the supplied WiFi network using
+// cached settings, returning false if there are none, or if they are
+// for a different network or have expired.
+bool wifiResume(const char * wifi) {
+  WifiCache * cache = &Rtc.wifi;
+  char ssid[WIFI_SIZE], *key;
+  if (wifi[0] == '\0' || cache->wifi != wifiChecksum(wifi) || clockTime() - cache->time > WIFI_LEASE) {
     return false;
   }
-
-  LocalAddress = WiFi.localIP();
-  if (Debug) Serial.print(F("Obtained DHCP IP address ")), Serial.println(LocalAddress);
+  strcpy(ssid, wifi);
+  key = strchr(ssid, ',');
+  if (key == NULL) {
+    key = ssid + strlen(ssid);
+  } else {
+    *key++ = '\0';
+  }
+  if (debugging()) Serial.print(F("Resuming WiFi on channel ")), Serial.println(cache->channel);
+  WiFi.config(IPAddress(cache->ip), IPAddress(cache->gateway), IPAddress(cache->subnet), IPAddress(cache->dns));
+  WiFi.begin(ssid, key, cache->channel, cache->bssid);
+  WifiTime = millis();
+  AssociateStart = micros();
+  DhcpStart = 0;
   return true;
 }
 
+// wifiSave caches the settings of the current WiFi connection.
+void wifiSave(const char * wifi) {
+  WifiCache * cache = &Rtc.wifi;
+  cache->wifi = wifiChecksum(wifi);
+  cache->time = clockTime();
+  memcpy(cache->bssid, WiFi.BSSID(), 6);
+  cache->channel = WiFi.channel();
+  cache->ip = (uint32_t)WiFi.localIP();
+  cache->gateway = (uint32_t)WiFi.gatewayIP();
+  cache->subnet = (uint32_t)WiFi.subnetMask();
+  cache->dns = (uint32_t)WiFi.dnsIP();
+  writeRtc();
+}
+
+// wifiForget clears cached WiFi settings and reverts to DHCP.
+void wifiForget() {
+  if (debugging()) Serial.println(F("Forgetting cached WiFi settings"));
+  memset((unsigned char *)&Rtc.wifi, 0, sizeof(WifiCache));
+  writeRtc();
+  WiFi.disconnect();
+  WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+}
+
+// wifiTask turns on the WiFi and associates with, first, the configured
+// hotspot and, second, the default hotspot, without blocking.
+// Association itself proceeds in the background in the WiFi stack,
+// so this task merely starts it and then polls for the outcome. When
+// settings from a recent connection to the configured hotspot are
+// cached, we first try reconnecting with those, i.e., a known BSSID and
+// channel and a static IP address, before falling back to a full
+// connection.
+// WiFi.waitForConnectResult can end up in an infinite loop, so don't use it!
+// NB: connecting can take several seconds, so ensure WIFI_ATTEMPTS x WIFI_DELAY is at least 5000ms.
+bool wifiTask() {
+  switch (WifiState) {
+  case wifiIdle:
+    if (!wifiControl(true)) {
+      WifiState = wifiFailed;
+      return true;
+    }
+    if (WiFi.status() != WL_CONNECTED && wifiResume(Config.wifi)) {
+      WifiState = wifiResuming;
+    } else if (wifiStart(Config.wifi)) {
+      WifiState = wifiConnecting;
+    } else if (WiFi.status() == WL_CONNECTED) {
+      WifiState = wifiConnected;
+      return true;
+    } else if (strcmp(Config.wifi, DEFAULT_WIFI) != 0 && wifiStart(DEFAULT_WIFI)) {
+      WifiState = wifiFallback;
+    } else {
+      WifiState = wifiFailed;
+      return true;
+    }
+    return false;
+
+  case wifiResuming:
+    if (WiFi.status() == WL_CONNECTED) {
+      LocalAddress = WiFi.localIP();
+      if (debugging()) Serial.print(F("Resumed with IP address ")), Serial.println(LocalAddress);
+      WifiState = wifiConnected;
+      return true;
+    }
+    if (elapsedMillis(WifiTime) < WIFI_RESUME_TIMEOUT) {
+      return false;
+    }
+    wifiForget();
+    WifiState = wifiStart(Config.wifi) ? wifiConnecting : wifiFailed;
+    return WifiState == wifiFailed;
+
+  case wifiConnecting:
+  case wifiFallback:
+    if (WiFi.status() == WL_CONNECTED) {
+      LocalAddress = WiFi.localIP();
+      if (debugging()) Serial.print(F("Obtained DHCP IP address ")), Serial.println(LocalAddress);
+      wifiSave(WifiState == wifiConnecting ? Config.wifi : DEFAULT_WIFI);
+      WifiState = wifiConnected;
+      return true;
+    }
+    if (elapsedMillis(WifiTime) < (unsigned long)WIFI_ATTEMPTS * WIFI_DELAY) {
+      return false;
+    }
+    if (debugging()) Serial.println(F("Failed to connect to WiFi"));
+    if (WifiState == wifiConnecting && strcmp(Config.wifi, DEFAULT_WIFI) != 0 && wifiStart(DEFAULT_WIFI)) {
+      WifiState = wifiFallback;
+      return false;
+    }
+    WifiState = wifiFailed;
+    return true;
+
+  default:
+    return true;
+  }
+}
+
 // wifiBegin attempts to begin a WiFi session, first, using the
-// configured hotspot and, second, using the default hotspot.
+// configured hotspot and, second, using the default hotspot,
+// and blocks until done.
 bool wifiBegin() {
-  bool ok = wifiControl(true);
-  if (ok) {
-    ok = wifiConnect(Config.wifi);
-    if (!ok && strcmp(Config.wifi, DEFAULT_WIFI) != 0) {
-      delay(WIFI_DELAY);
-      ok = wifiConnect(DEFAULT_WIFI);
+  WifiState = wifiIdle;
+  while (!wifiTask()) {
+    idleDelay(WIFI_DELAY);
+  }
+  return WifiState == wifiConnected;
+}
+
+// baseURL copies the scheme and host portion of a URL, i.e.,
+// everything before the path, to base, which is size bytes,
+// returning false if it does not fit.
+bool baseURL(const char * url, char * base, size_t size = MAX_HOST) {
+  const char * host = strstr(url, "://");
+  host = (host == NULL) ? url : host + 3;
+  const char * path = strchr(host, '/');
+  size_t len = (path == NULL) ? strlen(url) : path - url;
+  if (len >= size) {
+    return false;
+  }
+  memcpy(base, url, len);
+  base[len] = '\0';
+  return true;
+}
+
+// httpClose closes the HTTP session, if any.
+void httpClose() {
+  if (SessionURL[0] == '\0') {
+    return;
+  }
+  if (debugging()) Serial.print(F("Closing HTTP session with ")), Serial.println(SessionURL);
+  Client.stop();
+  SessionURL[0] = '\0';
+}
+
+// hasData returns true if a pin has binary data to be sent.
+bool hasData(Pin * pin) {
+  return pin->data != NULL && pin->value > 0;
+}
+
+// binaryData returns true if pins has data and only B pins have data,
+// i.e., the data is sensor data, rather than data such as the Wi-Fi
+// scan sent with config requests.
+bool binaryData(Pin * pins) {
+  bool found = false;
+  for (int ii = 0; ii < MAX_PINS && pins[ii].name[0] != '\0'; ii++) {
+    if (!hasData(&pins[ii])) {
+      continue;
     }
+    if (pins[ii].name[0] != 'B') {
+      return false;
+    }
+    found = true;
   }
-  return ok;
+  return found;
+}
+
+// PayloadStream streams the binary data of pins, in order, with the
+// value of each pin being the size of its data. It implements the peek
+// buffer API so that the HTTP client writes pin data directly to the
+// socket without copying it.
+class PayloadStream : public Stream {
+public:
+  PayloadStream(Pin * pins) : _pins(pins), _cur(0), _off(0), _remaining(0) {
+    for (int ii = 0; ii < MAX_PINS && pins[ii].name[0] != '\0'; ii++) {
+      if (hasData(&pins[ii])) {
+        _remaining += pins[ii].value;
+      }
+    }
+    next();
+  }
+
+  // size returns the number of bytes remaining.
+  size_t size() { return _remaining; }
+
+  int available() override { return _remaining; }
+  int peek() override { return _remaining == 0 ? -1 : _pins[_cur].data[_off]; }
+  int read() override {
+    int ch = peek();
+    if (ch != -1) {
+      peekConsume(1);
+    }
+    return ch;
+  }
+  size_t write(uint8_t) override { return 0; } // Read only.
+
+  bool hasPeekBufferAPI() const override { return true; }
+  size_t peekAvailable() override { return _remaining == 0 ? 0 : _pins[_cur].value - _off; }
+  const char* peekBuffer() override { return (const char*)_pins[_cur].data + _off; }
+  void peekConsume(size_t consume) override {
+    _off += consume;
+    _remaining -= consume;
+    next();
+  }
+
+private:
+  // next advances to the next unsent data, if the current pin has been sent.
+  void next() {
+    while (_remaining > 0 && (!hasData(&_pins[_cur]) || _off >= _pins[_cur].value)) {
+      _cur++;
+      _off = 0;
+    }
+  }
+
+  Pin * _pins;
+  int _cur;          // Current pin.
+  int _off;          // Offset into the current pin's data.
+  size_t _remaining; // Bytes remaining.
+};
+
+// Compression utilities:
+
+// LzTable is the compressor's hash table, which holds the position of
+// the last occurrence of each hashed 4-byte sequence, modulo 2^16.
+static uint16_t LzTable[1 << LZ_HASH_BITS];
+
+// LzSequence represents an LZ4 sequence, i.e., a run of literals followed
+// by a match, except for the last sequence of a block, which has no match.
+typedef struct {
+  int literals; // Number of literals.
+  int offset;   // Match offset, or 0 for the last sequence.
+  int length;   // Match length.
+} LzSequence;
+
+// lzRead32 reads 4 bytes, regardless of alignment.
+inline uint32_t lzRead32(const byte * data) {
+  uint32_t val;
+  memcpy(&val, data, 4);
+  return val;
+}
+
+// lzNext finds the next sequence of an LZ4 block of the n bytes of data,
+// starting from *pos, which is advanced past it. LzTable must be cleared
+// at the start of each block. Since positions are held modulo 2^16, a
+// candidate match may be stale, but any earlier position whose bytes
+// match is a valid match.
+void lzNext(const byte * data, int n, int * pos, LzSequence * seq) {
+  int anchor = *pos;
+  for (int ip = anchor; ip + LZ_MATCH_LIMIT <= n; ip++) {
+    uint32_t val = lzRead32(data + ip);
+    int hh = (uint32_t)(val * 2654435761U) >> (32 - LZ_HASH_BITS);
+    int offset = (uint16_t)(ip - LzTable[hh]);
+    LzTable[hh] = ip;
+    if (offset == 0 || offset > ip || lzRead32(data + ip - offset) != val) {
+      continue;
+    }
+    int length = LZ_MIN_MATCH;
+    while (ip + length < n - LZ_LAST_LITERALS && data[ip + length] == data[ip + length - offset]) {
+      length++;
+    }
+    seq->literals = ip - anchor;
+    seq->offset = offset;
+    seq->length = length;
+    *pos = ip + length;
+    return;
+  }
+  seq->literals = n - anchor;
+  seq->offset = 0;
+  seq->length = 0;
+  *pos = n;
+}
+
+// lzExtra returns the number of extra bytes used to encode an LZ4 length.
+int lzExtra(int len) {
+  return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+// lzSize returns the total size of the LZ4 blocks of pin data,
+// without encoding them.
+size_t lzSize(Pin * pins) {
+  size_t size = 0;
+  for (int ii = 0; ii < MAX_PINS && pins[ii].name[0] != '\0'; ii++) {
+    if (!hasData(&pins[ii])) {
+      continue;
+    }
+    memset(LzTable, 0, sizeof(LzTable));
+    LzSequence seq;
+    for (int pos = 0; pos < pins[ii].value; ) {
+      lzNext(pins[ii].data, pins[ii].value, &pos, &seq);
+      size += 1 + lzExtra(seq.literals) + seq.literals;
+      if (seq.offset != 0) {
+        size += 2 + lzExtra(seq.length - LZ_MIN_MATCH);
+      }
+    }
+  }
+  return size;
+}
+
+// Lz4Stream streams the binary data of pins, in order, as one LZ4 block
+// per pin, of the given total size, as computed by lzSize. Since the
+// value of each pin is the size of its data, blocks need no framing.
+// Sequences are encoded as they are read, so, besides LzTable, the only
+// buffer is for tokens, offsets and length runs, and literals are
+// written directly from the pin data, as by PayloadStream.
+class Lz4Stream : public Stream {
+public:
+  Lz4Stream(Pin * pins, size_t size) : _pins(pins), _cur(0), _pos(0), _stage(lzToken), _chunk(NULL), _len(0), _remaining(size) {
+    while (_remaining > 0 && !hasData(&_pins[_cur])) {
+      _cur++;
+    }
+    fill();
+  }
+
+  int available() override { return _remaining; }
+  int peek() override { return _remaining == 0 ? -1 : *_chunk; }
+  int read() override {
+    int ch = peek();
+    if (ch != -1) {
+      peekConsume(1);
+    }
+    return ch;
+  }
+  size_t write(uint8_t) override { return 0; } // Read only.
+
+  bool hasPeekBufferAPI() const override { return true; }
+  size_t peekAvailable() override { return _len; }
+  const char* peekBuffer() override { return (const char*)_chunk; }
+  void peekConsume(size_t consume) override {
+    _chunk += consume;
+    _len -= consume;
+    _remaining -= consume;
+    fill();
+  }
+
+private:
+  enum lzStage {
+    lzToken,
+    lzLiteralRun,
+    lzLiterals,
+    lzOffset,
+    lzMatchRun,
+    lzEnd,
+  };
+
+  // fill advances to the next chunk of encoded bytes, if the current chunk
+  // has been sent, where a chunk is either literals or bytes in _run.
+  void fill() {
+    while (_len == 0 && _remaining > 0) {
+      Pin * pin = &_pins[_cur];
+      switch (_stage) {
+      case lzToken:
+        if (_pos == 0) {
+          memset(LzTable, 0, sizeof(LzTable));
+        }
+        _chunk = pin->data + _pos;
+        lzNext(pin->data, pin->value, &_pos, &_seq);
+        _literals = _chunk;
+        _run[0] = (_seq.literals < 15 ? _seq.literals : 15) << 4;
+        if (_seq.offset != 0) {
+          _run[0] |= _seq.length - LZ_MIN_MATCH < 15 ? _seq.length - LZ_MIN_MATCH : 15;
+        }
+        _extra = _seq.literals < 15 ? -1 : _seq.literals - 15;
+        _chunk = _run;
+        _len = 1;
+        _stage = lzLiteralRun;
+        break;
+      case lzLiteralRun:
+        if (_extra < 0) {
+          _stage = lzLiterals;
+        } else {
+          runBytes();
+        }
+        break;
+      case lzLiterals:
+        _chunk = _literals;
+        _len = _seq.literals;
+        _stage = _seq.offset != 0 ? lzOffset : lzEnd;
+        break;
+      case lzOffset:
+        _run[0] = _seq.offset & 0xFF;
+        _run[1] = _seq.offset >> 8;
+        _chunk = _run;
+        _len = 2;
+        _extra = _seq.length - LZ_MIN_MATCH < 15 ? -1 : _seq.length - LZ_MIN_MATCH - 15;
+        _stage = lzMatchRun;
+        break;
+      case lzMatchRun:
+        if (_extra < 0) {
+          _stage = lzEnd;
+        } else {
+          runBytes();
+        }
+        break;
+      case lzEnd:
+        if (_pos >= pin->value) {
+          // Advance to the next block.
+          do {
+            _cur++;
+          } while (!hasData(&_pins[_cur]));
+          _pos = 0;
+        }
+        _stage = lzToken;
+        break;
+      }
+    }
+  }
+
+  // runBytes writes as much of the remaining length run as fits into _run,
+  // with the run ending in a byte less than 255.
+  void runBytes() {
+    _len = 0;
+    while (_len < LZ_RUN_SIZE && _extra >= 0) {
+      if (_extra >= 255) {
+        _run[_len++] = 255;
+        _extra -= 255;
+      } else {
+        _run[_len++] = _extra;
+        _extra = -1;
+      }
+    }
+    _chunk = _run;
+  }
+
+  Pin * _pins;
+  int _cur;                 // Current pin.
+  int _pos;                 // Position in the current pin's data following the current sequence.
+  lzStage _stage;           // Next stage of the current sequence.
+  LzSequence _seq;          // Current sequence.
+  const byte * _literals;   // Literals of the current sequence.
+  int _extra;               // Remainder of the current length run, or -1 when done.
+  const byte * _chunk;      // Current chunk.
+  size_t _len;              // Bytes remaining in the current chunk.
+  size_t _remaining;        // Bytes remaining.
+  byte _run[LZ_RUN_SIZE];
+};
+
+// ReplyStream is a write-only stream which receives a reply into a
+// fixed-size buffer, which is always null terminated. Writes fail
+// once the buffer is full.
+class ReplyStream : public Stream {
+public:
+  ReplyStream(char * buf, size_t size) : _buf(buf), _size(size), _len(0) {
+    _buf[0] = '\0';
+  }
+
+  int available() override { return 0; }
+  int peek() override { return -1; }
+  int read() override { return -1; }
+  size_t write(uint8_t ch) override { return write(&ch, 1); }
+  size_t write(const uint8_t * data, size_t sz) override {
+    if (_len + sz >= _size) {
+      return 0; // Too big.
+    }
+    memcpy(_buf + _len, data, sz);
+    _len += sz;
+    _buf[_len] = '\0';
+    return sz;
+  }
+
+private:
+  char * _buf;
+  size_t _size;
+  size_t _len;
+};
+
+// Compact wire format utilities:
+
+// putVarint writes an unsigned LEB128 varint, returning the number of bytes written.
+int putVarint(byte * buf, unsigned long val) {
+  int nn = 0;
+  while (val >= 0x80) {
+    buf[nn++] = (val & 0x7F) | 0x80;
+    val >>= 7;
+  }
+  buf[nn++] = val;
+  return nn;
+}
+
+// putZigzag writes a signed value as a zigzag-encoded varint, returning the number of bytes written.
+int putZigzag(byte * buf, long val) {
+  return putVarint(buf, ((unsigned long)val << 1) ^ (unsigned long)(val >> (sizeof(long) * 8 - 1)));
 }
 
-// httpRequest sends a request to an HTTP server and gets the response,
-// returning true on success or false otherwise.
-bool httpRequest(String url, String body, String& reply) {
-  HTTPClient http;
-  WiFiClient client;
+// compactBody encodes a request header and pin values in the compact
+// wire format into buf, which must be at least COMPACT_SIZE bytes,
+// returning the size. The format is as follows:
+//   Format          (1 byte)  // wireCompact
+//   Version         (varint)  // vn
+//   MAC address     (6 bytes) // ma
+//   Uptime          (varint)  // ut
+//   Pins, repeated until the end of the body:
+//     Type          (1 byte)  // 'A', 'D', 'X', etc.
+//     Number        (varint)
+//     Value         (zigzag varint)
+// Negative values are omitted, except for X10.
+int compactBody(byte * buf, Pin * pins, unsigned long ut) {
+  int nn = 0;
+  buf[nn++] = wireCompact;
+  nn += putVarint(buf + nn, VERSION);
+  memcpy(buf + nn, Mac, 6);
+  nn += 6;
+  nn += putVarint(buf + nn, ut);
+  for (int ii = 0; pins != NULL && ii < MAX_PINS && pins[ii].name[0] != '\0'; ii++) {
+    if (pins[ii].value < 0 && strcmp(pins[ii].name, "X10") != 0) {
+      if (debugging()) Serial.print(F("Warning: Not sending ")), Serial.println(pins[ii].name);
+      continue;
+    }
+    buf[nn++] = pins[ii].name[0];
+    nn += putVarint(buf + nn, atoi(pins[ii].name + 1));
+    nn += putZigzag(buf + nn, pins[ii].value);
+  }
+  return nn;
+}
 
-  bool get = body.length() == 0;
-  if (Debug) Serial.print(get ? F("GET ") : F("POST ")), Serial.println(url);
-  http.setTimeout(HTTP_TIMEOUT);
-  http.begin(client, url);
-  const char* locationHeader[] = {"Location"};
-  http.collectHeaders(locationHeader, 1);
-  if (!get) {
-    http.addHeader("Content-Type", "application/json");
+// httpRequest sends a request to an HTTP server and writes the response
+// to reply, which is size bytes, returning true on success or false
+// otherwise, including when the response does not fit.
+// The request is a POST if the body is non-empty or if pins is
+// non-NULL and has binary data, in which case the data is streamed
+// from the pins, else a GET. POST bodies are of the given content type.
+// If compress is true, streamed data is LZ4 compressed, with the
+// encoding advertised by the Content-Encoding header, unless it proves
+// to be incompressible.
+// The connection is kept alive for subsequent requests to the same host
+// until httpClose is called. Permanent redirects (301 and 308) are
+// cached in RTC memory, so that later requests, including those after
+// deep sleep, go directly to the final host. Other redirects are followed
+// but not cached, with a 303 followed by a GET as per RFC 7231. A failed
+// request reverts to the default service URL.
+bool httpRequest(const char * url, const char * body, char * reply, size_t size, Pin * pins = NULL, const char * type = "application/json", bool compress = false) {
+  bool stream = body[0] == '\0' && pins != NULL && PayloadStream(pins).size() > 0;
+  bool get = body[0] == '\0' && !stream;
+  size_t compressed = 0;
+  if (stream && compress) {
+    compressed = lzSize(pins);
+    if (debugging()) Serial.print(F("Compressed ")), Serial.print(PayloadStream(pins).size()), Serial.print(F(" to ")), Serial.println(compressed);
+    if (compressed >= PayloadStream(pins).size()) {
+      compressed = 0;
+    }
   }
-  auto status = get ? http.GET(): http.POST(body);
+  unsigned long start = micros();
+  static char location[MAX_URL]; // Static, since it is too big for the stack.
+  char base[MAX_HOST];
+  int status;
+
+  for (int redirects = 0; ; redirects++) {
+    if (!baseURL(url, base)) {
+      status = -1;
+      break;
+    }
+    if (strcmp(base, SessionURL) != 0) {
+      httpClose(); // Different host, so don't reuse the connection.
+      strcpy(SessionURL, base);
+    }
+    if (debugging()) Serial.print(get ? F("GET ") : F("POST ")), Serial.println(url);
+    Http.setTimeout(HTTP_TIMEOUT);
+    Http.setReuse(true);
+    Http.begin(Client, url);
+    const char* headers[] = {"Location", "Date"};
+    Http.collectHeaders(headers, 2);
+    if (!get) {
+      Http.addHeader("Content-Type", type);
+    }
+    if (compressed > 0) {
+      Http.addHeader("Content-Encoding", "x-lz4");
+      Lz4Stream payload(pins, compressed);
+      status = Http.sendRequest("POST", &payload, compressed);
+    } else if (stream) {
+      PayloadStream payload(pins);
+      status = Http.sendRequest("POST", &payload, payload.size());
+    } else {
+      status = get ? Http.GET(): Http.POST((const uint8_t *)body, strlen(body));
+    }
 
-  switch (status) {
-  case httpMovedPermanently:
-  case httpMovedTemporarily:
-  case httpSeeOther:
-  case httpTemporaryRedirect:
-  case httpPermanentRedirect:
-    url = http.header("Location");
-    if (Debug) Serial.print(F("Redirecting to: ")), Serial.println(url);
-    http.end();
-    return httpRequest(url, body, reply); // Redirect to the new location.
+    switch (status) {
+    case httpMovedPermanently:
+    case httpMovedTemporarily:
+    case httpSeeOther:
+    case httpTemporaryRedirect:
+    case httpPermanentRedirect:
+      padCopy(location, Http.header("Location").c_str(), MAX_URL);
+      url = location;
+      Http.end();
+      if (redirects >= MAX_REDIRECTS) {
+        if (debugging()) Serial.println(F("Warning: Too many redirects"));
+        break;
+      }
+      if (status == httpMovedPermanently || status == httpPermanentRedirect) {
+        if (!baseURL(url, Rtc.service, MAX_SERVICE)) {
+          if (debugging()) Serial.println(F("Warning: Redirect too long to cache"));
+          Rtc.service[0] = '\0';
+        }
+      }
+      if (status == httpSeeOther) {
+        body = ""; // See other is always followed by a GET.
+        stream = false;
+        get = true;
+        compressed = 0;
+      }
+      if (debugging()) Serial.print(F("Redirecting to: ")), Serial.println(url);
+      continue; // Redirect to the new location.
+    }
+    break;
   }
 
+  // The reply is written directly to the reply buffer, without using a String.
+  int len = -1;
   if (status == httpOK) {
-    reply = http.getString();
-    if (Debug) Serial.print(F("Reply: ")), Serial.println(reply);
-    http.end();
+    ReplyStream sink(reply, size);
+    len = Http.writeToStream(&sink);
+    unsigned long time = parseDate(Http.header("Date").c_str());
+    if (time != 0) {
+      syncClock(time);
+    }
+  }
+  Http.end();
+  if (len >= 0) {
+    stopTimer(tHttp, start);
+    if (debugging()) Serial.print(F("Reply: ")), Serial.println(reply);
     return true;
+  }
+
+  if (status == httpOK) {
+    if (debugging()) Serial.print(F("Warning: HTTP reply not received, error: ")), Serial.println(len);
   } else {
-    if (Debug) Serial.print(F("Warning: HTTP request failed with status: ")), Serial.println(status);
-    http.end();
-    return false;
+    if (debugging()) Serial.print(F("Warning: HTTP request failed with status: ")), Serial.println(status);
   }
+  httpClose();
+  Rtc.service[0] = '\0';
+  return false;
 }
 
-// Issue a single request, writing polled values to 'inputs' and actuated values to 'outputs'.
+// Issue a single request, writing polled values to 'inputs' and actuated values to the compiled 'outputs'.
 // Sets 'reconfig' true if reconfiguration is required, false otherwise.
+// Values of the optional 'fields' table are extracted from the reply,
+// which is held in Reply until the next request. The first 'backlog'
+// samples of Backlog, if any, are sent as a batched poll, in place of
+// current or buffered input values.
 // Side effects: 
 //   Updates VarSum global when differs from the varsum ("vs") parameter.
 //   Sets Configured global to false for update and alarm requests.
 //   Updates, enters debug mode or alarm mode, or reboots according to the response code ("rc").
-bool request(RequestType req, Pin * inputs, Pin * outputs, bool * reconfig, String& reply) {
-  char path[MAX_PATH];
-  String param;
-  String body;
-  bool ok;
+bool request(RequestType req, Pin * inputs, PinTable * outputs, bool * reconfig, JsonField * fields = NULL, int backlog = 0) {
+  static char url[MAX_URL]; // Static, since it is too big for the stack.
+  strcpy(url, Rtc.service[0] != '\0' ? Rtc.service : SVC_URL);
+  char * path = url + strlen(url); // The path is appended to the service URL.
+  bool fits = true;
+  const char * body = "";
   unsigned long ut = millis()/1000;
   *reconfig = false;
 
   switch (req) {
   case RequestConfig:
-    sprintf(path, "/config?vn=%d&ma=%s&dk=%s&la=%d.%d.%d.%d&ut=%ld", VERSION, MacAddress, Config.dkey,
-            LocalAddress[0], LocalAddress[1], LocalAddress[2], LocalAddress[3], ut);
+    fits = appendf(url, MAX_URL, "/config?vn=%d&ma=%s&dk=%s&la=%d.%d.%d.%d&ut=%ld&cf=%d", VERSION, MacAddress, Config.dkey,
+            LocalAddress[0], LocalAddress[1], LocalAddress[2], LocalAddress[3], ut, wireCompact);
     break;
   case RequestPoll:
-    sprintf(path, "/poll?vn=%d&ma=%s&dk=%s&ut=%ld", VERSION, MacAddress, Config.dkey, ut);
+    fits = appendf(url, MAX_URL, "/poll?vn=%d&ma=%s&dk=%s&ut=%ld", VERSION, MacAddress, Config.dkey, ut);
     break;
   case RequestAct:
-    sprintf(path, "/act?vn=%d&ma=%s&dk=%s&ut=%ld", VERSION, MacAddress, Config.dkey, ut);
+    fits = appendf(url, MAX_URL, "/act?vn=%d&ma=%s&dk=%s&ut=%ld", VERSION, MacAddress, Config.dkey, ut);
     break;
   case RequestVars:
-    sprintf(path, "/vars?vn=%d&ma=%s&dk=%s&ut=%ld", VERSION, MacAddress, Config.dkey, ut);
+    // The varsum of the vars we hold and the mask of the vars we use ask for only those that changed.
+    fits = appendf(url, MAX_URL, "/vars?vn=%d&ma=%s&dk=%s&ut=%ld&vs=%d&vm=%lx", VERSION, MacAddress, Config.dkey, ut,
+            Config.varsum, (unsigned long)usedVars());
     break;
   }
 
-  if (inputs != NULL) {
+  // Scalar poll and act requests use the compact wire format when negotiated.
+  // The text format is used otherwise, including for binary data and batched polls.
+  bool batched = (req == RequestPoll && inputs != NULL && (backlog > 0 || (Rtc.buffer.count > 0 && batching())));
+  bool compact = (Config.format == wireCompact && (req == RequestPoll || req == RequestAct) && !batched &&
+                  (inputs == NULL || PayloadStream(inputs).size() == 0));
+  byte compactData[COMPACT_SIZE];
+  Pin compactPins[2];
+  if (compact) {
+    *path = '\0';
+    fits = appendf(url, MAX_URL, "/%s?dk=%s&cf=%d", req == RequestPoll ? "poll" : "act", Config.dkey, wireCompact);
+    strcpy(compactPins[0].name, "cf");
+    compactPins[0].value = compactBody(compactData, inputs, ut);
+    compactPins[0].data = compactData;
+    compactPins[1].name[0] = '\0';
+  }
+
+  if (inputs != NULL && !compact && backlog == 0) {
     for (int ii = 0; ii < MAX_PINS && inputs[ii].name[0] != '\0'; ii++) {
       if (inputs[ii].value < 0 && strcmp(inputs[ii].name, "X10") != 0) {
         // Omit negative scalars (except X10) or missing/partial binary data.
-        if (Debug) Serial.print(F("Warning: Not sending ")), Serial.println(inputs[ii].name);
+        if (debugging()) Serial.print(F("Warning: Not sending ")), Serial.println(inputs[ii].name);
         continue;
       }
-      sprintf(path + strlen(path), "&%s=%d", inputs[ii].name, inputs[ii].value);
-      // Populate the body with binary data, if any.
-      if (inputs[ii].data != NULL && inputs[ii].value > 0) {
-        body += String((const char*)(inputs[ii].data));
-      }
+      fits = fits && appendf(url, MAX_URL, "&%s=%d", inputs[ii].name, inputs[ii].value);
+      // NB: Binary data, if any, is streamed from the pins by httpRequest.
+    }
+  }
+
+  // Buffered samples, if any, are sent as the body of a batched poll, with the batch size as "bn".
+  if (batched) {
+    if (backlog > 0) {
+      fits = fits && appendf(url, MAX_URL, "&bn=%d", backlog);
+      batchBody(Body, inputs, Backlog, 0, backlog, MAX_BATCH);
+    } else {
+      fits = fits && appendf(url, MAX_URL, "&bn=%d", Rtc.buffer.count);
+      batchBody(Body, inputs, Rtc.buffer.samples, Rtc.buffer.head, Rtc.buffer.count, MAX_SAMPLES);
     }
+    body = Body;
   }
 
-  if (httpRequest(String(SVC_URL)+String(path), body, reply)) {
+  if (!fits) {
+    if (debugging()) Serial.println(F("Error: Request URL too long"));
+    return false;
+  }
+
+  // Only the binary data of poll requests is compressed.
+  bool compress = (req == RequestPoll && Config.vars[pvCompression] == encodeLz4 && inputs != NULL && binaryData(inputs));
+
+  bool ok = compact ? httpRequest(url, body, Reply, MAX_REPLY, compactPins, "application/octet-stream")
+                    : httpRequest(url, body, Reply, MAX_REPLY, inputs, "application/json", compress);
+  if (ok) {
     if (XPin[xAlarmed]) {
       writeAlarm(false, true); // Reset alarm.
     }
-    NetworkFailures = 0;
+    Rtc.failures = 0;
+    Rtc.retries = 0;
+    if (backlog > 0) {
+      sentQueue(backlog);
+    } else if (batched) {
+      clearSamples();
+    } else if (req == RequestPoll && inputs != NULL && suppressing()) {
+      sentSample(inputs);
+    }
   } else {
-    NetworkFailures++;
-    if (Debug) Serial.print(F("Network failures: ")), Serial.println(NetworkFailures);
-    if (Config.vars[pvAlarmNetwork] > 0 && NetworkFailures >= Config.vars[pvAlarmNetwork]) {
+    Rtc.failures++;
+    if (debugging()) Serial.print(F("Network failures: ")), Serial.println(Rtc.failures);
+    if (Config.vars[pvAlarmNetwork] > 0 && Rtc.failures >= Config.vars[pvAlarmNetwork]) {
       // Too many network failures; raise the alarm!
       writeAlarm(true, false);
-      NetworkFailures = 0;
+      Rtc.failures = 0;
     }
     return false;
   }
 
-  if (!reply.startsWith("{")) {
-    if (Debug) Serial.println(F("Warning: Malformed response"));
+  // Extract output values, the response code, varsum and error, along
+  // with any fields requested by the caller, in a single pass.
+  JsonField replyFields[MAX_PINS + 4];
+  int nn = 0;
+  bool actuate = (req == RequestPoll || req == RequestAct) && outputs != NULL;
+  if (actuate) {
+    for (int ii = 0; ii < outputs->size; ii++) {
+      replyFields[nn++] = jsonField(outputs->pins[ii].name);
+    }
+  }
+  JsonField * rc = &replyFields[nn];
+  replyFields[nn++] = jsonField("rc");
+  JsonField * vs = &replyFields[nn];
+  replyFields[nn++] = jsonField("vs");
+  JsonField * er = &replyFields[nn];
+  replyFields[nn++] = jsonField("er");
+  replyFields[nn] = jsonField(NULL);
+  JsonField * tables[] = {replyFields, fields, NULL};
+  unsigned long start = micros();
+  if (!parseJson(Reply, tables)) {
+    if (debugging()) Serial.println(F("Warning: Malformed response"));
     return false;
   }
+  stopTimer(tParse, start);
 
   // Since version 138 and later, poll requests also return output values.
-  if (req == RequestPoll || req == RequestAct) {
-    bool found = false;
-    for (int ii = 0; ii < MAX_PINS && outputs[ii].name[0] != '\0'; ii++) {
-      if (extractJson(reply, outputs[ii].name, param)) {
-        outputs[ii].value = param.toInt();
-        writePin(&outputs[ii]);
+  if (actuate) {
+    for (int ii = 0; ii < outputs->size; ii++) {
+      Pin * pin = &outputs->pins[ii];
+      if (replyFields[ii].value != NULL) {
+        pin->value = fieldInt(&replyFields[ii]);
+        writePin(pin, &outputs->descs[ii]);
       } else {
-        outputs[ii].value = -1;
-        if (Debug) Serial.print(F("Warning: Missing value for output pin ")), Serial.println(outputs[ii].name);
+        pin->value = -1;
+        if (debugging()) Serial.print(F("Warning: Missing value for output pin ")), Serial.println(pin->name);
       }
     }
   }
 
-  if (extractJson(reply, "rc", param)) {
-    switch (param.toInt()) {
+  if (rc->value != NULL) {
+    switch (fieldInt(rc)) {
     case rcOK:
       break;
     case rcUpdate:
-      if (Debug) {
+      if (debugging()) {
         Serial.println(F("Received update request."));
       }
       *reconfig = true;
       Configured = false;
       break;
     case rcReboot:
-      if (Debug) Serial.println(F("Received reboot request."));
+      if (debugging()) Serial.println(F("Received reboot request."));
       if (Configured) {
         // Kill the power too.
         resetPowerPins();
@@ -821,7 +3259,7 @@ bool request(RequestType req, Pin * inputs, Pin * outputs, bool * reconfig, Stri
       }
       break;
     case rcAlarm:
-      if (Debug) Serial.println(F("Received alarm request."));
+      if (debugging()) Serial.println(F("Received alarm request."));
       if (Configured && Config.vars[pvAlarmPeriod] > 0) {
         writeAlarm(true, false);
         *reconfig = true;
@@ -833,17 +3271,17 @@ bool request(RequestType req, Pin * inputs, Pin * outputs, bool * reconfig, Stri
     }
   }
 
-  if (extractJson(reply, "vs", param)) {
-    int vs = param.toInt();
-    if (vs != VarSum) {
-      if (Debug) Serial.println(F("Varsum changed"));
+  if (vs->value != NULL) {
+    int val = fieldInt(vs);
+    if (val != VarSum) {
+      if (debugging()) Serial.println(F("Varsum changed"));
     }
-    VarSum = vs;
+    VarSum = val;
   }
 
-  if (extractJson(reply, "er", param)) {
+  if (er->value != NULL) {
     // we let the caller deal with errors
-    if (Debug) Serial.print(F("Error: ")), Serial.println(param);
+    if (debugging()) Serial.print(F("Error: ")), printField(er);
   }
 
   return true;
@@ -853,10 +3291,14 @@ bool request(RequestType req, Pin * inputs, Pin * outputs, bool * reconfig, Stri
 // Side effects:
 //   Sets Configured global to true upon success.
 bool config() {
-  String reply, error, param;
   bool reconfig = false;
   bool changed = false;
   Pin pins[2];
+  JsonField fields[] = {
+    jsonField("mp"), jsonField("ap"), jsonField("wi"), jsonField("dk"),
+    jsonField("ip"), jsonField("op"), jsonField("cf"), jsonField("er"), jsonField(NULL)
+  };
+  JsonField * field;
 
   // As of v160, var types (vt) are sent with config requests.
   strcpy(pins[0].name, "vt");
@@ -864,40 +3306,57 @@ bool config() {
   pins[0].data = (byte*)VarTypes;
   pins[1].name[0] = '\0';
 
-  if (!request(RequestConfig, pins, NULL, &reconfig, reply) || extractJson(reply, "er", param)) {
+  if (!request(RequestConfig, pins, NULL, &reconfig, fields) || findField(fields, "er")->value != NULL) {
     cyclePin(LED_PIN, 2, false);
     return false;
   } 
-  if (Debug) Serial.print(F("Config response: ")), Serial.println(reply);
+  if (debugging()) Serial.print(F("Config response: ")), Serial.println(Reply);
 
-  if (extractJson(reply, "mp", param) && param.toInt() != Config.monPeriod) {
-    Config.monPeriod = param.toInt();
-    if (Debug) Serial.print(F("Mon. period changed: ")), Serial.println(Config.monPeriod);
+  field = findField(fields, "mp");
+  if (field->value != NULL && fieldInt(field) != Config.monPeriod) {
+    Config.monPeriod = fieldInt(field);
+    if (debugging()) Serial.print(F("Mon. period changed: ")), Serial.println(Config.monPeriod);
     changed = true;
   }
-  if (extractJson(reply, "ap", param) && param.toInt() != Config.actPeriod) {
-    Config.actPeriod = param.toInt();
-    if (Debug) Serial.print(F("Act. period changed: ")), Serial.println(Config.actPeriod);
+  field = findField(fields, "ap");
+  if (field->value != NULL && fieldInt(field) != Config.actPeriod) {
+    Config.actPeriod = fieldInt(field);
+    if (debugging()) Serial.print(F("Act. period changed: ")), Serial.println(Config.actPeriod);
     changed = true;
   }
-  if (extractJson(reply, "wi", param) && param != Config.wifi) {
-    padCopy(Config.wifi, param.c_str(), WIFI_SIZE);
-    if (Debug) Serial.print(F("Wifi changed: ")), Serial.println(Config.wifi);
+  field = findField(fields, "wi");
+  if (field->value != NULL && !fieldEquals(field, Config.wifi)) {
+    fieldCopy(field, Config.wifi, WIFI_SIZE);
+    if (debugging()) Serial.print(F("Wifi changed: ")), Serial.println(Config.wifi);
     changed = true;
   }
-  if (extractJson(reply, "dk", param) && param != Config.dkey) {
-    padCopy(Config.dkey, param.c_str(), DKEY_SIZE);
-    if (Debug) Serial.print(F("Dkey changed: ")), Serial.println(Config.dkey);
+  field = findField(fields, "dk");
+  if (field->value != NULL && !fieldEquals(field, Config.dkey)) {
+    fieldCopy(field, Config.dkey, DKEY_SIZE);
+    if (debugging()) Serial.print(F("Dkey changed: ")), Serial.println(Config.dkey);
     changed = true;
   }
-  if (extractJson(reply, "ip", param) && param != Config.inputs) {
-    padCopy(Config.inputs, param.c_str(), IO_SIZE);
-    if (Debug) Serial.print(F("Inputs changed: ")), Serial.println(Config.inputs);
+  field = findField(fields, "ip");
+  if (field->value != NULL && !fieldEquals(field, Config.inputs)) {
+    fieldCopy(field, Config.inputs, IO_SIZE);
+    if (debugging()) Serial.print(F("Inputs changed: ")), Serial.println(Config.inputs);
+    clearSamples(); // Buffered and queued values no longer correspond to the inputs.
+    clearQueue();
     changed = true;
   }
-  if (extractJson(reply, "op", param) && param != Config.outputs) {
-    padCopy(Config.outputs, param.c_str(), IO_SIZE);
-    if (Debug) Serial.print(F("Outputs changed: ")), Serial.println(Config.outputs);
+  field = findField(fields, "op");
+  if (field->value != NULL && !fieldEquals(field, Config.outputs)) {
+    fieldCopy(field, Config.outputs, IO_SIZE);
+    if (debugging()) Serial.print(F("Outputs changed: ")), Serial.println(Config.outputs);
+    changed = true;
+  }
+
+  // The compact wire format is only used if the service supports it.
+  field = findField(fields, "cf");
+  int format = (field->value != NULL && fieldInt(field) == wireCompact) ? wireCompact : wireText;
+  if (format != Config.format) {
+    Config.format = format;
+    if (debugging()) Serial.print(F("Wire format changed: ")), Serial.println(Config.format);
     changed = true;
   }
 
@@ -913,30 +3372,51 @@ bool config() {
 // Retrieve vars from data host, return the persistent vars and
 // set changed to true if a persistent var has changed.
 // Transient vars, such as "id" are not saved.
-// Missing persistent vars default to 0, except for peak voltage and auto restart.
+// Only the vars we use are requested, along with the varsum of those
+// we hold, so that the service can reply with just the vars that
+// changed, which it signals with "dv". Otherwise missing persistent vars
+// default to 0, except for peak voltage and auto restart. Unused vars
+// keep their current values either way.
 bool getVars(int vars[MAX_VARS], bool* changed) {
-  String reply, error, id, param;
   bool reconfig;
+  JsonField fields[MAX_VARS + 4];
+  int index[MAX_VARS]; // Var index of each field.
+  uint32_t used = usedVars();
+  int nn = 0;
   *changed = false;
 
-  if (!request(RequestVars, NULL, NULL, &reconfig, reply) || extractJson(reply, "er", param)) {
-    return false;
+  for (int ii = 0; ii < MAX_VARS; ii++) {
+    vars[ii] = Config.vars[ii];
+    if (used & 1UL << ii) {
+      index[nn] = ii;
+      fields[nn++] = jsonField(PvNames[ii], true);
+    }
   }
-  bool hasId = extractJson(reply, "id", id);
-  if (hasId && Debug) Serial.print(F("id=")), Serial.println(id);
+  JsonField * id = &fields[nn];
+  fields[nn] = jsonField("id");
+  JsonField * dv = &fields[nn + 1];
+  fields[nn + 1] = jsonField("dv");
+  fields[nn + 2] = jsonField("er");
+  fields[nn + 3] = jsonField(NULL);
 
-  for  (int ii = 0; ii < MAX_VARS; ii++) {
-    int val = 0;
-    if (hasId) {
-      String var = id + '.' + String(PvNames[ii]);
-      if (extractJson(reply, var.c_str(), param)) {
-        val = param.toInt();
-      }
-    } else {
-      if (extractJson(reply, PvNames[ii], param)) {
-        val = param.toInt();
-      }
+  if (!request(RequestVars, NULL, NULL, &reconfig, fields) || findField(fields, "er")->value != NULL) {
+    return false;
+  }
+  bool hasId = id->value != NULL;
+  if (hasId && debugging()) Serial.print(F("id=")), printField(id);
+  bool delta = dv->value != NULL && fieldInt(dv) != 0;
+  if (delta && debugging()) Serial.println(F("Received changed vars only"));
+
+  for (int jj = 0; jj < nn; jj++) {
+    int ii = index[jj];
+    JsonField * field = &fields[jj];
+    // When we have an id, vars are prefixed by it, e.g., "id.Pulses".
+    bool present = field->value != NULL &&
+                   (hasId ? (field->prefixSize == id->size && strncmp(field->prefix, id->value, id->size) == 0) : field->prefixSize == 0);
+    if (delta && !present) {
+      continue; // Unchanged.
     }
+    int val = present ? fieldInt(field) : 0;
 
     // Set values for variables with non-zero defaults.
     if (val == 0) {
@@ -951,13 +3431,18 @@ bool getVars(int vars[MAX_VARS], bool* changed) {
     }
     vars[ii] = val;
 
-    if (Debug) Serial.print(PvNames[ii]), Serial.print(F("=")), Serial.print(vars[ii]);
+    if (debugging()) Serial.print(PvNames[ii]), Serial.print(F("=")), Serial.print(vars[ii]);
     if (Config.vars[ii] != val) {
       *changed = true;
-      if (Debug) Serial.print(F("!=")), Serial.print(Config.vars[ii]);
+      if (debugging()) Serial.print(F("!=")), Serial.print(Config.vars[ii]);
      }
      Serial.println(F(""));
   }
+  // The vars now reflect the current varsum, which is saved with them.
+  if (Config.varsum != VarSum) {
+    Config.varsum = VarSum;
+    *changed = true;
+  }
 
   // Clamp alarm voltages so as to not exceed the peak voltage.
   if (vars[pvAlarmVoltage] > vars[pvPeakVoltage]) {
@@ -978,23 +3463,33 @@ bool getVars(int vars[MAX_VARS], bool* changed) {
 
 // write vars
 void writeVars(int vars[MAX_VARS]) {
-  if (Debug) Serial.println(F("Writing vars"));
+  if (debugging()) Serial.println(F("Writing vars"));
   memcpy(Config.vars, vars, sizeof(Config.vars));
   writeConfig(&Config);
 }
 
-// init should be called from setup once
+// init should be called from setup once.
+// When waking from deep sleep, which happens every cycle for devices
+// that deep sleep, we skip the delay for the serial monitor to settle.
 void init(void) {
+  Woke = ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
   // Disable WiFi persistence in flash memory.
   WiFi.persistent(false);
   WiFi.mode(WIFI_STA);
   Serial.begin(115200);
   pinMode(LED_PIN, OUTPUT);
   digitalWrite(LED_PIN, HIGH);
-  delay(2000);
+  if (!Woke) {
+    delay(2000);
+  }
 
   // Get Config.
   readConfig(&Config);
+  // Get data which persists across deep sleep.
+  readRtc();
+  initTimers();
+  // Mount the store-and-forward queue.
+  startQueue();
   // Get boot info.
   XPin[xBoot] = Config.boot;
   Serial.print(F("Boot reason: ")), Serial.println(Config.boot);
@@ -1005,20 +3500,58 @@ void init(void) {
   writeAlarm(false, true);
 
   // Save the formatted MAC address.
-  byte mac[6];
-  WiFi.macAddress(mac);
-  fmtMacAddress(mac, MacAddress);
+  WiFi.macAddress(Mac);
+  fmtMacAddress(Mac, MacAddress);
+
+  // Time association and DHCP.
+  AssociatedHandler = WiFi.onStationModeConnected(onAssociated);
+  AddressedHandler = WiFi.onStationModeGotIP(onAddressed);
+}
+
+// backoffPeriod returns the milliseconds to wait before retrying after a failed cycle.
+// The period starts at RETRY_PERIOD and doubles with each consecutive failure, up to the
+// monitor period (or MAX_BACKOFF), so that a device never retries less often than it
+// would otherwise cycle. A random "jitter" of up to half the period is subtracted so
+// that devices recovering from a shared outage do not all retry in lockstep.
+unsigned long backoffPeriod() {
+  unsigned long cap = Config.monPeriod > MAX_BACKOFF ? MAX_BACKOFF : Config.monPeriod;
+  if (cap < RETRY_PERIOD) {
+    cap = RETRY_PERIOD;
+  }
+  unsigned long period = RETRY_PERIOD;
+  for (int ii = 0; ii < Rtc.retries && period < cap; ii++) {
+    period *= 2;
+  }
+  if (period > cap) {
+    period = cap;
+  }
+  if (Rtc.retries < 0xFFFF) {
+    Rtc.retries++;
+  }
+  period *= 1000;
+  return period - ESP.random() % (period / 2 + 1);
 }
 
 // Pause to maintain timing accuracy, adjusting the timing lag in the process.
 // Pulsed is how long we've pulsed in milliseconds, or the equivalent delay if suppressing pulses.
-// If we're here because of a problem and we're not pulsing, we just pause long enough to retry,
-// since timing accuracy is moot. If pulsing, we pause for the active time remaining this cycle,
-// unless we're out of time.
+// If we're here because of a problem and we're not pulsing, we just back off before retrying,
+// since timing accuracy is moot. Devices that deep sleep between cycles also deep sleep during
+// long backoffs, whereas others stay awake so as not to lose background state, such as alarms.
+// If pulsing, we pause for the active time remaining this cycle, unless we're out of time.
+// Background tasks, such as pulsing or a temporary alarm, are completed first.
 bool pause(bool ok, unsigned long pulsed, long * lag) {
+  finishTasks();
+  if (pulsed > 0) {
+    pulsed += PulseLate; // Account for pulses that finished later than scheduled.
+    PulseLate = 0;
+  }
   if (!ok && pulsed == 0) {
-    if (Debug) Serial.print(F("Retrying in ")), Serial.print(RETRY_PERIOD), Serial.println(F("s"));
-    delay(RETRY_PERIOD * 1000L);
+    unsigned long period = backoffPeriod();
+    if (debugging()) Serial.print(F("Retrying in ")), Serial.print(period), Serial.println(F("ms"));
+    if (period >= SLEEP_BACKOFF * 1000UL && Config.monPeriod != Config.actPeriod) {
+      deepSleep(period);
+    }
+    longDelay(period);
     return ok;
   }
 
@@ -1026,7 +3559,16 @@ bool pause(bool ok, unsigned long pulsed, long * lag) {
   long remaining = Config.actPeriod * 1000L - pulsed;
   *lag += (now - Time - pulsed);
 
-  if (Debug) {
+  // Devices that don't deep sleep pause until the next cycle is due by server time, if known.
+  long scheduled = Config.monPeriod == Config.actPeriod ? scheduledDelay(Config.monPeriod) : -1;
+  if (scheduled >= 0) {
+    if (debugging()) Serial.print(F("Pausing until scheduled for ")), Serial.print(scheduled), Serial.println(F("ms"));
+    longDelay(scheduled);
+    *lag = 0;
+    return ok;
+  }
+
+  if (debugging()) {
     Serial.print(F("Pulsed time: ")), Serial.print(pulsed), Serial.println(F("ms"));
     Serial.print(F("Total lag: ")), Serial.print(*lag), Serial.println(F("ms"));
     Serial.print(F("Run time: ")), Serial.print(now - Time), Serial.println(F("ms"));
@@ -1034,15 +3576,62 @@ bool pause(bool ok, unsigned long pulsed, long * lag) {
 
   if (remaining > *lag) {
     remaining -= *lag;
-    if (Debug) Serial.print(F("Pausing for ")), Serial.print(remaining), Serial.println(F("ms"));
+    if (debugging()) Serial.print(F("Pausing for ")), Serial.print(remaining), Serial.println(F("ms"));
     longDelay(remaining);
     *lag = 0;
   } else {
-    if (Debug) Serial.println(F("Skipped pause"));
+    if (debugging()) Serial.println(F("Skipped pause"));
   }
   return ok;
 }
 
+// flushQueue sends samples from the store-and-forward queue in batches
+// of up to MAX_BATCH samples, for at most QUEUE_BATCHES batches, so as to
+// bound the duration of a cycle. It returns false upon a network failure.
+bool flushQueue(Pin * inputs) {
+  bool reconfig;
+  for (int ii = 0; Queueing && ii < QUEUE_BATCHES; ii++) {
+    int count = readQueue();
+    if (count == 0) {
+      break;
+    }
+    if (debugging()) Serial.print(F("Sending queued samples: ")), Serial.println(count);
+    if (!request(RequestPoll, inputs, NULL, &reconfig, NULL, count)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// sendChunks sends any further chunks that are ready, each as a poll of
+// just the binary pins, over the kept-alive connection, so that chunks
+// that become ready faster than the cycle are not held back, for at most
+// MAX_CHUNKS chunks per cycle. It returns false upon a network failure.
+bool sendChunks(bool * reconfig) {
+  Pin pins[MAX_PINS + 1];
+  for (int nn = 1; nn < MAX_CHUNKS && Chunks.ready && Chunks.more; nn++) {
+    Chunks.pending = Chunks.ready = Chunks.more = false;
+    int np = 0;
+    for (int ii = 0; ii < Inputs.size; ii++) {
+      if (Inputs.descs[ii].type == 'B') {
+        pins[np] = Inputs.pins[ii];
+        readChunk(&pins[np++]);
+      }
+    }
+    pins[np].name[0] = '\0';
+    if (!Chunks.ready) {
+      break;
+    }
+    bool rc;
+    if (!request(RequestPoll, pins, NULL, &rc)) {
+      return false;
+    }
+    *reconfig = *reconfig || rc;
+    sentChunks();
+  }
+  return true;
+}
+
 // run should be called from loop until it returns true, e.g., 
 //  while (!run(&varsum)) {
 //    ;
@@ -1050,8 +3639,7 @@ bool pause(bool ok, unsigned long pulsed, long * lag) {
 // May return false while either connected to WiFi or not.
 // NB: pulse suppression must be re-enabled each cycle via the X14 pin.
 bool run(int* varsum) {
-  Pin inputs[MAX_PINS], outputs[MAX_PINS];
-  String reply;
+  Pin * inputs = Inputs.pins;
   bool reconfig = false;
   unsigned long pulsed = 0;
   long lag = 0;
@@ -1059,10 +3647,15 @@ bool run(int* varsum) {
   int vars[MAX_VARS];
   bool changed;
 
+  // Start from the saved varsum, so vars are not requested again after a restart unless they changed.
+  if (*varsum == 0) {
+    *varsum = Config.varsum;
+  }
+
   // Measure lag to maintain accuracy between cycles.
   if (Time > 0 && now > Time) {
     lag = (long)(now - Time) - (Config.monPeriod * 1000L);
-    if (Debug) Serial.print(F("Initial lag: ")), Serial.print(lag), Serial.println(F("ms"));
+    if (debugging()) Serial.print(F("Initial lag: ")), Serial.print(lag), Serial.println(F("ms"));
     if (lag < 0) {
       lag = 0;
     }
@@ -1076,7 +3669,7 @@ bool run(int* varsum) {
     // Attempt to refresh vars in case the recent alarm was due to operator error.
     if (wifiBegin() && getVars(vars, &changed)) {
       if (changed) {
-        if (Debug) Serial.println(F("Persistent variable(s) changed"));
+        if (debugging()) Serial.println(F("Persistent variable(s) changed"));
         writeVars(vars);
       }
       *varsum = VarSum;
@@ -1092,7 +3685,7 @@ bool run(int* varsum) {
     } else { // rolled over
       alarmed = ((0xffffffff - AlarmedTime) + now)/1000;
     }
-    if (Debug) Serial.print(F("Alarm duration: ")), Serial.print(alarmed), Serial.println(F("s"));
+    if (debugging()) Serial.print(F("Alarm duration: ")), Serial.print(alarmed), Serial.println(F("s"));
     if (alarmed >= Config.vars[pvAutoRestart]) {
       restart(bootAlarm, false);
     }
@@ -1103,31 +3696,38 @@ bool run(int* varsum) {
     printConfig();
   }
 
-  // Pulsing happens before anything else, regardless of network connectivity.
-  if (Config.vars[pvPulses] != 0 && Config.vars[pvPulseWidth] != 0) {
-    pulsePin(LED_PIN, Config.vars[pvPulses], Config.vars[pvPulseWidth], Config.vars[pvPulseDutyCycle]);
-    pulsed = (unsigned long)Config.vars[pvPulses] * Config.vars[pvPulseWidth] * 1000L;
-    long gap = (Config.vars[pvPulseCycle] * 1000L) - (long)pulsed;
+  // Pulsing starts before anything else, regardless of network connectivity,
+  // and continues in the background while we read inputs and use the network.
+  // Pulse groups repeat every PulseCycle seconds for the monitoring period.
+  if (NetSenderTraits::pulses && Config.vars[pvPulses] != 0 && Config.vars[pvPulseWidth] != 0) {
+    int groups = 1;
+    long gap = (Config.vars[pvPulseCycle] * 1000L) - ((long)Config.vars[pvPulses] * Config.vars[pvPulseWidth] * 1000L);
     if (gap > 0) {
       for (int spanned = 0; spanned < Config.monPeriod - Config.vars[pvPulseCycle]; spanned += Config.vars[pvPulseCycle]) {
-        if (Debug) Serial.print(F("Pulse group gap: ")), Serial.print(gap), Serial.println(F("ms"));
-        longDelay(gap);
-        pulsePin(LED_PIN, Config.vars[pvPulses], Config.vars[pvPulseWidth], Config.vars[pvPulseDutyCycle]);
-        pulsed += (gap + ((unsigned long)Config.vars[pvPulses] * Config.vars[pvPulseWidth]));
+        groups++;
       }
+    } else {
+      gap = 0;
     }
+    pulsed = startPulses(LED_PIN, Config.vars[pvPulses], Config.vars[pvPulseWidth], Config.vars[pvPulseDutyCycle], groups, gap);
+    Pulse.cycle = true;
+    PulseLate = 0;
+    addTask(pulseTask, true);
   }
   XPin[xPulseSuppress] = 0;
 
+  // Sampling, if any, also runs in the background, driven by a hardware timer.
+  setSampleRate(Config.vars[pvSampleRate]);
+
   // Check voltage if we have an alarm voltage.
-  if (Config.vars[pvAlarmVoltage] > 0) {
+  if (NetSenderTraits::alarms && Config.vars[pvAlarmVoltage] > 0) {
     Pin pin = { "A0" };
-    if (Debug) Serial.println(F("Checking voltage"));
+    if (debugging()) Serial.println(F("Checking voltage"));
     XPin[xA0] = readPin(&pin);
     if (XPin[xA0] < Config.vars[pvAlarmVoltage]) {
       if (!XPin[xAlarmed]) {
         // low voltage; raise the alarm and turn off WiFi!
-        if (Debug) Serial.println(F("Low voltage alarm!"));
+        if (debugging()) Serial.println(F("Low voltage alarm!"));
         cyclePin(LED_PIN, 5, true);
         writeAlarm(true, true);
         wifiControl(false);
@@ -1138,33 +3738,72 @@ bool run(int* varsum) {
       if (XPin[xA0] < Config.vars[pvAlarmRecoveryVoltage]) {
         return pause(false, pulsed, &lag);
       }
-      if (Debug) Serial.println(F("Low voltage alarm cleared"));
+      if (debugging()) Serial.println(F("Low voltage alarm cleared"));
       writeAlarm(false, true);
     }
     if (XPin[xA0] > Config.vars[pvPeakVoltage]) {
-      if (Debug) Serial.println(F("Warning: High voltage"));
+      if (debugging()) Serial.println(F("Warning: High voltage"));
     }
   } else {
     XPin[xA0] = -1;
-    if (Debug) Serial.println(F("Skipped voltage check"));
+    if (debugging()) Serial.println(F("Skipped voltage check"));
   }
 
   // Read inputs, if any.
-  // NB: We do this before we are connected to the network.
-  for (int ii = 0, sz = setPins(Config.inputs, inputs); ii < sz; ii++) {
-    readPin(&inputs[ii]);
+  // NB: We do this before we are connected to the network, although
+  // association starts concurrently when EarlyWiFi is true, unless
+  // batching or suppressing since we may not need the network this cycle.
+  bool early = EarlyWiFi && !batching() && !suppressing();
+  WifiState = wifiIdle;
+  if (early) {
+    addTask(wifiTask);
+  }
+  int sz = Inputs.size;
+  if (aggregating()) {
+    startAggregate();
+    addTask(aggregateTask);
+  } else {
+    Aggregate.count = 0;
+  }
+  startReads(&Inputs);
+  addTask(readTask);
+  runTasks();
+
+  // When batching, buffer the sample and skip the network until it is time to poll.
+  if (batching() && bufferSample(inputs, sz)) {
+    wifiControl(false); // No-op if WiFi is not on.
+    return complete(pulsed, lag);
+  }
+
+  // When suppressing, skip the network unless an input has changed beyond the deadband.
+  if (suppressing() && !changedSample(inputs, sz)) {
+    if (debugging()) Serial.println(F("Inputs unchanged, skipping poll"));
+    wifiControl(false); // No-op if WiFi is not on.
+    return complete(pulsed, lag);
+  }
+
+  // Likewise, skip the network while a chunked capture has nothing to send.
+  if (chunksPending()) {
+    if (debugging()) Serial.println(F("Chunk pending, skipping poll"));
+    wifiControl(false); // No-op if WiFi is not on.
+    return complete(pulsed, lag);
   }
 
   // Turn on WiFI, connect, and then send input values and/or receive output values.
-  if (!wifiBegin()) {
-    NetworkFailures++;
-    if (Config.vars[pvAlarmNetwork] > 0 && NetworkFailures >= Config.vars[pvAlarmNetwork]) {
+  if (!early) {
+    addTask(wifiTask);
+    runTasks();
+  }
+  if (WifiState != wifiConnected) {
+    Rtc.failures++;
+    if (Config.vars[pvAlarmNetwork] > 0 && Rtc.failures >= Config.vars[pvAlarmNetwork]) {
       // too many network failures; raise the alarm!
       writeAlarm(true, false);
-      NetworkFailures = 0;
+      Rtc.failures = 0;
     } else {
       cyclePin(LED_PIN, 3, false);
     }
+    queueSamples(inputs, sz);
     wifiControl(false); // No-op if WiFi is not on.
     return pause(false, pulsed, &lag);
   }
@@ -1181,8 +3820,13 @@ bool run(int* varsum) {
 
   // Since version 138 the poll method returns outputs as well as inputs,
   if (Config.inputs[0] != '\0') {
-    setPins(Config.outputs, outputs);
-    if (!request(RequestPoll, inputs, outputs, &reconfig, reply)) {
+    if (!request(RequestPoll, inputs, &Outputs, &reconfig)) {
+      queueSamples(inputs, sz);
+      wifiControl(false);
+      return pause(false, pulsed, &lag);
+    }
+    sentChunks();
+    if (ChunkReader != NULL && !sendChunks(&reconfig)) {
       wifiControl(false);
       return pause(false, pulsed, &lag);
     }
@@ -1190,8 +3834,7 @@ bool run(int* varsum) {
 
   // so we only need to call the act method in if there are no inputs.
   if (Config.inputs[0] == '\0' && Config.outputs[0] != '\0') {
-    setPins(Config.outputs, outputs);
-    if (!request(RequestAct, NULL, outputs, &reconfig, reply)) {
+    if (!request(RequestAct, NULL, &Outputs, &reconfig)) {
       wifiControl(false);
       return pause(false, pulsed, &lag);
     }
@@ -1208,46 +3851,50 @@ bool run(int* varsum) {
       return pause(false, pulsed, &lag);
     }
     if (changed) {
-      if (Debug) Serial.println(F("Persistent variable(s) changed"));
+      if (debugging()) Serial.println(F("Persistent variable(s) changed"));
       writeVars(vars);
     }
     *varsum = VarSum;
   }
 
+  // Send samples queued during a network outage, if any.
+  if (Config.inputs[0] != '\0') {
+    flushQueue(inputs);
+  }
+
   wifiControl(false);
+  return complete(pulsed, lag);
+}
 
+// complete completes a successful cycle, pausing for the remainder of the
+// active period then deep sleeping for the remainder of the monitoring
+// period, if any.
+bool complete(unsigned long pulsed, long lag) {
   // Adjust for pulse timing inaccuracy and network time.
   pause(true, pulsed, &lag);
   cyclePin(LED_PIN, 1, false);
   if (Config.monPeriod == Config.actPeriod) {
-    if (Debug) Serial.println(F("Cycle complete"));
+    if (debugging()) Serial.println(F("Cycle complete"));
     return true;
   }
   
   long remaining;
-  if (Config.actPeriod * 1000L > pulsed) {
+  if (Config.actPeriod * 1000L > (long)pulsed) {
     remaining = (Config.monPeriod - Config.actPeriod) * 1000L;
   } else {
     remaining = Config.monPeriod * 1000L - pulsed;
   }
+  long scheduled = scheduledDelay(Config.monPeriod);
+  if (scheduled >= 0) {
+    remaining = scheduled; // Sleep until the next cycle is due by server time instead.
+    lag = 0;
+  }
   if (remaining > lag) {
     remaining -= lag;
-    if (Debug) Serial.print(F("Deep sleeping for ")), Serial.print(remaining), Serial.println(F("ms"));
-    ESP.deepSleep(remaining * 1000L);
+    if (debugging()) Serial.print(F("Deep sleeping for ")), Serial.print(remaining), Serial.println(F("ms"));
+    deepSleep(remaining);
   }
   return true;
 }
 
-// calculated elapsed milliseconds taking into account rollover.
-// Note that an unsigned long is only 32 bits.
-unsigned long elapsedMillis(unsigned long from) {
-  unsigned long elapsed, now = millis();
-  if (now >= from) {
-    elapsed = now - from;
-  } else {
-    elapsed = (0xffffffff - from) + now; // Rolled over.
-  }
-  return elapsed;
-}
-
 } // end namespace
@@ -29,15 +29,48 @@
 
 namespace NetSender {
 
-#define VERSION                173
+#define VERSION                183
 
 #define WIFI_SIZE              80
 #define DKEY_SIZE              20
-#define MAX_PINS               10
-#define PIN_SIZE               4
+#define MAX_PINS               32  // Maximum number of inputs, or outputs.
+#define PIN_SIZE               8   // Maximum pin name size, including the null terminator.
 #define IO_SIZE                (MAX_PINS * PIN_SIZE)
-#define MAX_VARS               10
-#define RESERVED_SIZE          48
+#define MAX_VARS               20  // Number of persistent vars.
+#define SAMPLE_VALUES          6
+#define RTC_USER_BLOCK         116 // First RTC user memory block (of 128 x 4 bytes) not used by NetSender.
+
+// NetSenderTraits selects the subsystems compiled into NetSender, all
+// of which are included by default. A subsystem is excluded by defining
+// the corresponding macro wherever NetSender.cpp is compiled, e.g., in
+// the sketch's <sketch>.ino.globals.h (ESP8266 core 3.1.0 and later):
+//   NETSENDER_NO_PULSES: Pulses vars are ignored.
+//   NETSENDER_NO_POWER:  No power pins (relays), nor their vars.
+//   NETSENDER_NO_ALARMS: No network or voltage alarms, nor the alarm pin.
+//   NETSENDER_NO_DEBUG:  No debug output, i.e., Debug is ignored.
+// Excluded code is discarded by the compiler, reducing flash usage.
+struct NetSenderTraits {
+#ifdef NETSENDER_NO_PULSES
+  static constexpr bool pulses = false;
+#else
+  static constexpr bool pulses = true;
+#endif
+#ifdef NETSENDER_NO_POWER
+  static constexpr bool power = false;
+#else
+  static constexpr bool power = true;
+#endif
+#ifdef NETSENDER_NO_ALARMS
+  static constexpr bool alarms = false;
+#else
+  static constexpr bool alarms = true;
+#endif
+#ifdef NETSENDER_NO_DEBUG
+  static constexpr bool debug = false;
+#else
+  static constexpr bool debug = true;
+#endif
+};
 
 typedef enum {
   RequestConfig = 0,
@@ -46,17 +79,10 @@ typedef enum {
   RequestVars   = 3,
 } RequestType;
 
-// Configuration parameters are saved to the first 256 bytes of EEPROM as follows:
-//   Version        (length 2)
-//   Mon. period    (length 2)
-//   Act. period    (length 2)
-//   Boot           (length 2)
-//   WiFi ssid,key  (length 80)
-//   Device key     (length 20)
-//   Inputs         (length 40) // 10 x 4
-//   Outputs        (length 40) // 10 x 4
-//   Vars           (length 20) // 10 x 2
-//   Reserved       (length 48)
+// Configuration parameters are saved to EEPROM as length-prefixed
+// fields, so sizes below can change without migrating the config
+// (see readConfig and writeConfig).
+// Inputs and outputs are comma-separated pin names.
 typedef struct {
   int version;
   int monPeriod;
@@ -67,7 +93,8 @@ typedef struct {
   char inputs[IO_SIZE];
   char outputs[IO_SIZE];
   int  vars[MAX_VARS];
-  char reserved[RESERVED_SIZE];
+  int  format;
+  int  varsum;
 } Configuration;
 
 // Pin represents a pin name and value and optional POST data.
@@ -80,20 +107,83 @@ typedef struct {
 // ReaderFunc represents a pin reading function.
 typedef int (*ReaderFunc)(Pin *);
 
+// Binary states, returned by a ChunkReaderFunc.
+typedef enum {
+  binFailed   = -1, // The capture failed; the chunk is requested again next cycle.
+  binPending  = 0,  // The capture is in progress, with the chunk not yet ready.
+  binPartial  = 1,  // The chunk is ready and more chunks will follow.
+  binComplete = 2,  // The chunk is ready and is the final chunk.
+} binaryState;
+
+// ChunkReaderFunc represents a resumable binary pin reading function,
+// which is requested the chunk with the given index, starting from 0.
+// When the chunk is ready, the reader sets the pin's value to its size
+// and its data to the chunk, otherwise it must return without blocking.
+typedef binaryState (*ChunkReaderFunc)(Pin *, int);
+
+// Reading represents a timestamped set of values taken by the sampler.
+typedef struct {
+  unsigned long time; // Time in microseconds, as returned by micros().
+  int16_t values[SAMPLE_VALUES];
+} Reading;
+
+// SamplerFunc represents a sampling function, which sets the values of a reading.
+typedef void (*SamplerFunc)(Reading *);
+
+// IdleFunc represents a function called while NetSender waits.
+typedef void (*IdleFunc)();
+
 // exported globals
 extern Configuration Config;
 extern ReaderFunc ExternalReader;
 extern ReaderFunc BinaryReader;
+extern ChunkReaderFunc ChunkReader;
 extern int VarSum;
 extern bool Debug;
+extern bool EarlyWiFi;
+extern SamplerFunc Sampler;
+extern IdleFunc Idler;
 
 // init should be called from setup once.
 // run should be called from loop until it returns true, e.g., 
 //  while (!run(&vs)) {
-//    delay(RETRY_PERIOD * (long)1000);
+//    ;
 //  }
+// Run backs off exponentially after failures, so callers need not delay.
+// Set EarlyWiFi true to associate with WiFi while inputs are being
+// read, rather than afterwards, which shortens each cycle when readers
+// are slow. Leave it false if readers are sensitive to radio activity,
+// e.g., ADC readings.
+// Set Sampler to sample at SampleRate Hz (a persistent var) from a
+// hardware timer interrupt, then call getReading from the main loop,
+// e.g., from a BinaryReader, to dequeue readings in order. Since the
+// sampler runs in an ISR it must be brief, ISR safe and marked
+// ICACHE_RAM_ATTR, e.g., reading GPIO registers. NB: Wire (I2C) and SPI
+// are not ISR safe, so sensors on those buses should instead be read
+// from an Idler when a flag set by a Ticker is due, as does
+// 9dof-netsender. The timer is shared with analogWrite, so the sampler
+// is not started while there are analog (A) outputs.
+// Set Idler to do brief work from the main loop whenever run waits,
+// i.e., while it pauses between cycles, backs off, runs tasks, turns
+// WiFi on or off or awaits HTTP replies, but not while connecting or
+// sending, e.g., to read a sensor when a flag set by a Ticker is due.
+// Set ChunkReader, in place of BinaryReader, for binary captures that
+// span cycles. Chunks are sent as they become ready, with the index of
+// the chunk reported as X94, and a chunk is requested again until it
+// has been sent, even across deep sleep. Further chunks that are ready
+// are sent straight away, up to 8 per cycle. Cycles in which a capture
+// has nothing to send, and nothing else to do, skip the network
+// altogether.
+// NetSender maintains X0-X14, including the mean phase times as X3-X9,
+// the aggregate statistics as X70-X73, and the minimum and maximum
+// phase times and the chunk index as X80-X94. All other X pins are read
+// by the ExternalReader, if any.
+// The binary data of B pins is sent LZ4 compressed with poll requests
+// when the Compression var is 1, with each pin's value remaining the
+// uncompressed size of its data.
 extern void init();
 extern bool run(int*);
+extern bool getReading(Reading*);
 
 } // end namespace
 #endif
@@ -0,0 +1,255 @@
+/*
+  Name:
+    bench - micro-benchmarks for NetSender on the host.
+
+  Description:
+    Benchmarks request building, reply parsing, the config journal,
+    compression and a full run cycle against a fake service, reporting
+    the mean time and heap allocations per operation. NetSender.cpp is
+    included directly, so as to benchmark its internal functions.
+    Times are host times, so compare them between builds on the same
+    host, rather than with device timings. Heap allocations include
+    those by the fakes, which allocate where the ESP core would too,
+    e.g., when HTTPClient returns a header as a String.
+
+    Usage: bench [-v] [benchmark name prefix]
+
+  License:
+    Copyright (C) 2026 The Australian Ocean Lab (AusOcean).
+
+    This file is part of NetSender. NetSender is free software: you can
+    redistribute it and/or modify it under the terms of the GNU
+    General Public License as published by the Free Software
+    Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    NetSender is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetSender in gpl.txt.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <new>
+#include "fakes.h"
+#include "../NetSender.cpp"
+
+#define BENCH_TIME 200 // Minimum real milliseconds per benchmark.
+#define BENCH_INPUTS "A0,D5,X10,X11,X12,X13,X20,X21,X22,X23" // Scalar inputs, i.e., SAMPLE_PINS of them.
+#define BENCH_OUTPUTS "D0,D2,D4"
+
+// Heap allocation counters, which count all allocations via new.
+static size_t Allocs = 0;
+static size_t AllocBytes = 0;
+
+void * operator new(size_t size) {
+  Allocs++;
+  AllocBytes += size;
+  void * ptr = malloc(size);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void * ptr) noexcept { free(ptr); }
+void operator delete(void * ptr, size_t) noexcept { free(ptr); }
+
+using namespace NetSender;
+
+// Replies of the fake service.
+static const char * ConfigReply = "{\"mp\":60,\"ap\":60,\"dk\":\"10000000\",\"ip\":\"" BENCH_INPUTS "\",\"op\":\"" BENCH_OUTPUTS "\",\"cf\":1,\"rc\":0,\"vs\":1}";
+static const char * PollReply = "{\"D0\":1,\"D2\":0,\"D4\":1,\"rc\":0,\"vs\":1}";
+static const char * VarsReply = "{\"id\":\"bench\",\"bench.Pulses\":0,\"bench.PulseWidth\":0,\"bench.PulseDutyCycle\":50,\"bench.PulseCycle\":0,"
+  "\"bench.AutoRestart\":600,\"bench.AlarmPeriod\":0,\"bench.AlarmNetwork\":10,\"bench.AlarmVoltage\":0,\"bench.AlarmRecoveryVoltage\":0,"
+  "\"bench.PeakVoltage\":845,\"bench.BatchSize\":0,\"bench.BatchPeriod\":0,\"bench.Deadband\":0,\"bench.SilencePeriod\":0,"
+  "\"bench.SampleRate\":0,\"bench.AggregatePin\":0,\"bench.AggregateRate\":0,\"bench.AggregateCount\":0,\"bench.Phase\":0,"
+  "\"bench.Compression\":0,\"Other.Unused\":\"x\",\"vs\":1}";
+
+// service is the fake service, which replies according to the request path.
+int service(const Fake::Request& req, std::string * reply) {
+  const char * path = strstr(req.url.c_str() + strlen("http://"), "/");
+  if (strncmp(path, "/config", 7) == 0) {
+    *reply = ConfigReply;
+  } else if (strncmp(path, "/vars", 5) == 0) {
+    *reply = VarsReply;
+  } else if (strncmp(path, "/poll", 5) == 0 || strncmp(path, "/act", 4) == 0) {
+    *reply = PollReply;
+  } else {
+    return 404;
+  }
+  return httpOK;
+}
+
+// setup boots the fake device and runs its first cycle, which configures it.
+void setup() {
+  static int varsum = 0;
+  Fake::reset();
+  Fake::Service = service;
+  Fake::Date = "Wed, 14 Oct 2026 12:00:00 GMT";
+  init();
+  Debug = Fake::Verbose;
+  if (!run(&varsum) || !run(&varsum)) {
+    fprintf(stderr, "setup failed\n");
+    exit(1);
+  }
+  for (int ii = 0; ii < Inputs.size; ii++) {
+    Inputs.pins[ii].value = 100 * ii;
+  }
+}
+
+// Benchmarks.
+
+void benchRun() {
+  static int varsum = VarSum;
+  run(&varsum);
+}
+
+void benchPollText() {
+  bool reconfig;
+  Config.format = wireText;
+  request(RequestPoll, Inputs.pins, &Outputs, &reconfig);
+}
+
+void benchPollCompact() {
+  bool reconfig;
+  Config.format = wireCompact;
+  request(RequestPoll, Inputs.pins, &Outputs, &reconfig);
+}
+
+void benchVars() {
+  int vars[MAX_VARS];
+  bool changed;
+  getVars(vars, &changed);
+}
+
+void benchParsePoll() {
+  JsonField fields[] = {jsonField("D0"), jsonField("D2"), jsonField("D4"), jsonField("rc"), jsonField("vs"), jsonField("er"), jsonField(NULL)};
+  JsonField * tables[] = {fields, NULL};
+  parseJson(PollReply, tables);
+}
+
+void benchParseVars() {
+  JsonField fields[MAX_VARS + 2];
+  for (int ii = 0; ii < MAX_VARS; ii++) {
+    fields[ii] = jsonField(PvNames[ii], true);
+  }
+  fields[MAX_VARS] = jsonField("id");
+  fields[MAX_VARS + 1] = jsonField(NULL);
+  JsonField * tables[] = {fields, NULL};
+  parseJson(VarsReply, tables);
+}
+
+void benchCompactBody() {
+  byte buf[COMPACT_SIZE];
+  compactBody(buf, Inputs.pins, 123456);
+}
+
+void benchVarint() {
+  byte buf[10 * 8];
+  int nn = 0;
+  for (unsigned long val = 1; val < 1UL << 28; val <<= 3) {
+    nn += putVarint(buf + nn, val);
+  }
+}
+
+void benchSetPins() {
+  Pin pins[MAX_PINS + 1];
+  setPins(BENCH_INPUTS, pins, MAX_PINS);
+}
+
+void benchInitPins() {
+  initPins(false);
+}
+
+void benchWriteConfig() {
+  Config.vars[pvPhase] ^= 1;
+  writeConfig(&Config);
+}
+
+void benchReadConfig() {
+  Configuration config;
+  readConfig(&config);
+}
+
+void benchCompress() {
+  static byte data[4096];
+  static bool init = false;
+  if (!init) {
+    // Frames of slowly varying floats, as from an IMU.
+    for (size_t ii = 0; ii < sizeof(data) / sizeof(float); ii++) {
+      float val = 9.81f + (ii / 12) * 0.0625f;
+      memcpy(data + ii * sizeof(float), &val, sizeof(float));
+    }
+    init = true;
+  }
+  Pin pins[2];
+  strcpy(pins[0].name, "B0");
+  pins[0].value = sizeof(data);
+  pins[0].data = data;
+  pins[1].name[0] = '\0';
+  Lz4Stream stream(pins, lzSize(pins));
+  while (stream.available() > 0) {
+    stream.peekConsume(stream.peekAvailable());
+  }
+}
+
+typedef struct {
+  const char * name;
+  void (*func)();
+} Benchmark;
+
+Benchmark Benchmarks[] = {
+  {"run/cycle",           benchRun},
+  {"request/poll-text",   benchPollText},
+  {"request/poll-compact", benchPollCompact},
+  {"request/vars",        benchVars},
+  {"json/poll-reply",     benchParsePoll},
+  {"json/vars-reply",     benchParseVars},
+  {"wire/compact-body",   benchCompactBody},
+  {"wire/varint",         benchVarint},
+  {"pins/set",            benchSetPins},
+  {"pins/init",           benchInitPins},
+  {"config/write",        benchWriteConfig},
+  {"config/read",         benchReadConfig},
+  {"lz4/4KB-floats",      benchCompress},
+};
+
+int main(int argc, char ** argv) {
+  const char * prefix = "";
+  for (int ii = 1; ii < argc; ii++) {
+    if (strcmp(argv[ii], "-v") == 0) {
+      Fake::Verbose = true;
+      setvbuf(stdout, NULL, _IOLBF, 0);
+    } else {
+      prefix = argv[ii];
+    }
+  }
+
+  printf("%-22s %12s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "bytes/op");
+  for (Benchmark& bench : Benchmarks) {
+    if (strncmp(bench.name, prefix, strlen(prefix)) != 0) {
+      continue;
+    }
+    setup();
+    bench.func(); // Warm up.
+    size_t allocs = Allocs, bytes = AllocBytes;
+    long ops = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration elapsed;
+    do {
+      for (int ii = 0; ii < 16; ii++) {
+        bench.func();
+      }
+      ops += 16;
+      elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(BENCH_TIME));
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    printf("%-22s %12.0f %12.1f %12.1f\n", bench.name, ns / ops, (double)(Allocs - allocs) / ops, (double)(AllocBytes - bytes) / ops);
+  }
+  return 0;
+}
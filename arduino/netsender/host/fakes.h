@@ -0,0 +1,82 @@
+/*
+  Name:
+    fakes - controls for the NetSender host fakes.
+
+  Description:
+    Controls for the host fakes of the Arduino and ESP APIs, which are
+    declared by nonarduino.h and implemented by nonarduino.cpp.
+
+  License:
+    Copyright (C) 2026 The Australian Ocean Lab (AusOcean).
+
+    This file is part of NetSender. NetSender is free software: you can
+    redistribute it and/or modify it under the terms of the GNU
+    General Public License as published by the Free Software
+    Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    NetSender is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetSender in gpl.txt.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef Fakes_H
+#define Fakes_H
+
+#include <string>
+#include "../nonarduino.h"
+
+namespace Fake {
+
+// Request represents an HTTP request received by the fake service.
+struct Request {
+  std::string method;
+  std::string url;
+  std::string body;
+  std::string type;     // Content-Type header, if any.
+  std::string encoding; // Content-Encoding header, if any.
+};
+
+// ServiceFunc represents the fake service, which writes the reply to a
+// request and returns the HTTP status code, or a negative error.
+typedef int (*ServiceFunc)(const Request& req, std::string* reply);
+
+extern ServiceFunc Service;   // The fake service, or NULL to fail requests.
+extern std::string Date;      // Date header returned with replies, or empty for none.
+extern std::string Location;  // Location header returned with replies, or empty for none.
+extern uint64_t Clock;        // Mock time in microseconds, advanced by delay and deepSleep.
+extern bool RealTime;         // Advance the clock with the host's clock, with delays taking real time.
+extern unsigned long AssociateTime; // Mock milliseconds taken to associate with WiFi.
+extern unsigned long DhcpTime;      // Mock milliseconds taken to obtain an address thereafter.
+extern uint32_t ResetReason;  // Reason returned by ESP.getResetInfoPtr.
+extern int AnalogValue;       // Value returned by analogRead.
+extern int DeepSleeps;        // Number of calls to ESP.deepSleep.
+extern int Restarts;          // Number of calls to ESP.restart.
+extern int Stops;             // Number of calls to WiFiClient::stop, i.e., HTTP sessions closed.
+extern uint8_t Mac[6];        // MAC address returned by WiFi.macAddress.
+extern bool Verbose;          // Write Serial output to stdout.
+
+// ResetFunc is called, if set, when the ESP would reset, i.e., upon
+// ESP.restart or at the end of ESP.deepSleep, with the reset reason.
+// Unlike the ESP, the fakes otherwise return, so as to continue running.
+typedef void (*ResetFunc)(uint32_t reason);
+
+extern ResetFunc OnReset;     // Called upon reset, or NULL to return.
+
+// reset erases the flash, RTC memory and file system, disconnects the
+// WiFi and resets the other controls to their defaults, except for the
+// clock, which only ever advances.
+void reset();
+
+// advance advances the clock by the given number of microseconds,
+// firing any tickers that fall due, in order.
+void advance(uint64_t us);
+
+} // end namespace
+
+#endif
@@ -0,0 +1,717 @@
+/*
+  Name:
+    load - fleet load generator for NetSender services.
+
+  Description:
+    Simulates a fleet of NetSender devices against a target service, so
+    that the service can be load tested at fleet scale. Each virtual
+    device runs the real client, i.e., NetSender.cpp against the host
+    fakes, in a process of its own, since NetSender's state is global,
+    as on the ESP. The fakes follow the host's clock in real time and
+    the fake service forwards each request to the target over HTTP/1.1,
+    keeping the connection alive until NetSender closes its session.
+    Requests, wire formats, compression, batching, backoff, scheduling
+    and deep sleep are therefore those of the client, as negotiated
+    with the service. Deep sleeps and restarts reboot the device, i.e.,
+    init runs again with flash and RTC memory retained.
+
+    Devices have distinct MAC addresses and device keys and start with
+    the given inputs, outputs and periods, as if configured by an
+    earlier config request, whereafter the service's config and vars
+    replies take precedence, as usual. Binary B0 inputs carry slowly
+    varying 16-bit samples, as from a sensor.
+
+    Latency percentiles, throughput and error rates are reported per
+    request type every report period and again on exit, counting each
+    redirect as a request. Requests that fail, return an error status
+    or an "er" are counted as errors.
+
+    Usage: load-netsender [-url URL] [-devices N] [-duration s] [-ramp s]
+             [-report s] [-inputs pins] [-outputs pins] [-mp s] [-ap s]
+             [-binary bytes] [-compact] [-lz4] [-mac prefix] [-dkey base]
+             [-seed N] [-v]
+
+    E.g., load-netsender -url http://localhost:8080 -devices 1000 -binary 4096 -lz4 -duration 600
+
+  License:
+    Copyright (C) 2026 The Australian Ocean Lab (AusOcean).
+
+    This file is part of NetSender. NetSender is free software: you can
+    redistribute it and/or modify it under the terms of the GNU
+    General Public License as published by the Free Software
+    Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    NetSender is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetSender in gpl.txt.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "fakes.h"
+#include "../NetSender.cpp"
+
+using namespace NetSender;
+
+#define MAX_BINARY 65536 // Maximum size of a binary payload.
+
+// Request types, named after their service paths.
+enum loadRequest {
+  loadConfig,
+  loadPoll,
+  loadAct,
+  loadVars,
+  loadOther,
+  loadTypes
+};
+
+static const char * LoadNames[loadTypes] = {"config", "poll", "act", "vars", "other"};
+
+// Record is the outcome of a single request, which devices write to
+// the stats pipe. NB: Records are smaller than PIPE_BUF, so writes are atomic.
+typedef struct {
+  uint8_t type;          // Request type (see loadRequest).
+  uint8_t failed;        // True if the request failed.
+  uint16_t unused;
+  uint32_t latency;      // Microseconds from sending the request to receiving the reply.
+  uint32_t bytes;        // Bytes sent, including headers.
+} Record;
+
+// Params holds the parameters shared by all virtual devices.
+typedef struct {
+  std::string url;
+  int devices;
+  int duration;          // Seconds.
+  int ramp;              // Seconds over which devices are started.
+  int report;            // Seconds between interim reports, or 0 for none.
+  std::string inputs;
+  std::string outputs;
+  int monPeriod;
+  int actPeriod;
+  int binary;            // Size of binary payloads, or 0 for none.
+  bool compact;
+  bool lz4;
+  unsigned mac[2];       // First two octets of the MAC addresses.
+  long long dkey;        // Device key of the first device.
+  long seed;
+  bool verbose;
+} Params;
+
+// Stats accumulates latencies and errors for one request type.
+typedef struct {
+  std::vector<uint32_t> latencies;
+  long errors;
+} Stats;
+
+// Device globals, i.e., per process.
+static std::string Target;       // Target service URL, which stands in for SVC_URL.
+static int StatsPipe = -1;       // Write end of the stats pipe.
+static int Sock = -1;            // Socket of the kept-alive connection, or -1 if none.
+static std::string SockHost;     // Host and port of the kept-alive connection.
+static int SockStops = 0;        // Fake::Stops when the connection was made.
+static int BinarySize = 0;
+static byte Binary[MAX_BINARY];
+
+// Reboot is thrown by onReset, since the ESP does not return from a reset.
+struct Reboot {
+  uint32_t reason;
+};
+
+void onReset(uint32_t reason) {
+  throw Reboot{reason};
+}
+
+// requestType returns the type of the request with the given path.
+loadRequest requestType(const std::string& path) {
+  for (int ii = 0; ii < loadOther; ii++) {
+    size_t len = strlen(LoadNames[ii]);
+    if (path.compare(1, len, LoadNames[ii]) == 0 && (path.size() == len + 1 || path[len + 1] == '?')) {
+      return (loadRequest)ii;
+    }
+  }
+  return loadOther;
+}
+
+// splitURL splits an http URL into its host, port and path, returning false if it is not one.
+bool splitURL(const std::string& url, std::string * host, std::string * port, std::string * path) {
+  if (url.compare(0, 7, "http://") != 0) {
+    return false;
+  }
+  size_t slash = url.find('/', 7);
+  std::string authority = url.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+  *path = slash == std::string::npos ? "/" : url.substr(slash);
+  size_t colon = authority.find(':');
+  *host = authority.substr(0, colon);
+  *port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+  return !host->empty();
+}
+
+// closeSession closes the kept-alive connection, if any.
+void closeSession() {
+  if (Sock >= 0) {
+    close(Sock);
+    Sock = -1;
+  }
+}
+
+// connectTo connects to the given host and port, returning the socket, or -1 on failure.
+int connectTo(const std::string& host, const std::string& port) {
+  struct addrinfo hints = {};
+  struct addrinfo * addrs;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+    return -1;
+  }
+  int sock = -1;
+  for (struct addrinfo * addr = addrs; addr != NULL && sock < 0; addr = addr->ai_next) {
+    sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock < 0) {
+      continue;
+    }
+    struct timeval timeout = {HTTP_TIMEOUT / 1000, (HTTP_TIMEOUT % 1000) * 1000};
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0) {
+      close(sock);
+      sock = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  return sock;
+}
+
+// sendAll writes all of msg to the socket, returning false on failure.
+bool sendAll(int sock, const std::string& msg) {
+  for (size_t sent = 0; sent < msg.size(); ) {
+    ssize_t nn = send(sock, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+    if (nn <= 0) {
+      return false;
+    }
+    sent += nn;
+  }
+  return true;
+}
+
+// Response reads an HTTP/1.1 response from a socket.
+class Response {
+public:
+  Response(int sock) : _sock(sock), _pos(0) {}
+
+  // read reads the response, writing the body to body, returning the
+  // status code, or -1 if no complete response was read. Sets keep to
+  // false if the server closes the connection or asks for it to be closed.
+  int read(std::string * body, bool * keep) {
+    std::string line;
+    *keep = true;
+    if (!readLine(&line) || line.compare(0, 5, "HTTP/") != 0 || line.size() < 12) {
+      return -1;
+    }
+    int status = atoi(line.c_str() + 9);
+    if (line.compare(0, 8, "HTTP/1.0") == 0) {
+      *keep = false;
+    }
+    long length = -1;
+    bool chunked = false;
+    Fake::Date.clear();
+    Fake::Location.clear();
+    while (readLine(&line) && !line.empty()) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      size_t start = line.find_first_not_of(' ', colon + 1);
+      std::string value = start == std::string::npos ? "" : line.substr(start);
+      if (name == "content-length") {
+        length = atol(value.c_str());
+      } else if (name == "transfer-encoding") {
+        chunked = value.find("chunked") != std::string::npos;
+      } else if (name == "connection") {
+        std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+        *keep = value.find("close") == std::string::npos;
+      } else if (name == "date") {
+        Fake::Date = value;
+      } else if (name == "location") {
+        Fake::Location = value;
+      }
+    }
+    if (!line.empty()) {
+      return -1; // Headers incomplete.
+    }
+
+    body->clear();
+    if (chunked) {
+      for (;;) {
+        if (!readLine(&line)) {
+          return -1;
+        }
+        long size = strtol(line.c_str(), NULL, 16);
+        if (size == 0) {
+          while (readLine(&line) && !line.empty()) {
+            ; // Discard trailers.
+          }
+          return status;
+        }
+        if (!readBytes(size, body) || !readLine(&line)) {
+          return -1;
+        }
+      }
+    }
+    if (length >= 0) {
+      return readBytes(length, body) ? status : -1;
+    }
+    *keep = false; // The body is delimited by the connection closing.
+    while (fill()) {
+      ;
+    }
+    body->append(_buf, _pos, std::string::npos);
+    return status;
+  }
+
+private:
+  // fill reads more data into the buffer, returning false on EOF or error.
+  bool fill() {
+    char data[4096];
+    ssize_t nn = recv(_sock, data, sizeof(data), 0);
+    if (nn <= 0) {
+      return false;
+    }
+    _buf.append(data, nn);
+    return true;
+  }
+
+  // readLine reads a CRLF terminated line, without the CRLF.
+  bool readLine(std::string * line) {
+    size_t end;
+    while ((end = _buf.find("\r\n", _pos)) == std::string::npos) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    *line = _buf.substr(_pos, end - _pos);
+    _pos = end + 2;
+    return true;
+  }
+
+  // readBytes appends size bytes to dst.
+  bool readBytes(size_t size, std::string * dst) {
+    while (_buf.size() - _pos < size) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    dst->append(_buf, _pos, size);
+    _pos += size;
+    return true;
+  }
+
+  int _sock;
+  std::string _buf;
+  size_t _pos;
+};
+
+// record writes the outcome of a request to the stats pipe.
+void record(loadRequest type, bool failed, uint64_t latency, size_t bytes) {
+  Record rec = {(uint8_t)type, failed, 0, (uint32_t)latency, (uint32_t)bytes};
+  if (write(StatsPipe, &rec, sizeof(rec)) != sizeof(rec)) {
+    exit(1); // The generator has gone.
+  }
+}
+
+// forward is the fake service, which forwards requests for SVC_URL to
+// the target and others, i.e., redirects, as is, reusing the connection
+// until NetSender closes its session, as the ESP client does. A
+// kept-alive connection that the server has since closed is retried
+// once on a new connection.
+int forward(const Fake::Request& req, std::string * reply) {
+  std::string url = req.url;
+  if (url.compare(0, strlen(SVC_URL), SVC_URL) == 0 && (url.size() == strlen(SVC_URL) || url[strlen(SVC_URL)] == '/')) {
+    url = Target + url.substr(strlen(SVC_URL));
+  }
+  std::string host, port, path;
+  if (!splitURL(url, &host, &port, &path)) {
+    return -1; // HTTPC_ERROR_CONNECTION_FAILED
+  }
+  std::string hostPort = host + ":" + port;
+  if (Sock >= 0 && (hostPort != SockHost || Fake::Stops != SockStops)) {
+    closeSession();
+  }
+
+  std::string msg = req.method + " " + path + " HTTP/1.1\r\n";
+  msg += "Host: " + (port == "80" ? host : hostPort) + "\r\n";
+  msg += "User-Agent: ESP8266HTTPClient\r\n";
+  msg += "Connection: keep-alive\r\n";
+  msg += "Accept-Encoding: identity;q=1,chunked;q=0.1,*;q=0\r\n";
+  if (!req.type.empty()) {
+    msg += "Content-Type: " + req.type + "\r\n";
+  }
+  if (!req.encoding.empty()) {
+    msg += "Content-Encoding: " + req.encoding + "\r\n";
+  }
+  if (req.method != "GET") {
+    msg += "Content-Length: " + std::to_string(req.body.size()) + "\r\n";
+  }
+  msg += "\r\n" + req.body;
+
+  auto start = std::chrono::steady_clock::now();
+  int status = -1;
+  for (int attempt = 0; attempt < 2 && status < 0; attempt++) {
+    bool reused = Sock >= 0;
+    if (Sock < 0) {
+      Sock = connectTo(host, port);
+      if (Sock < 0) {
+        break;
+      }
+      SockHost = hostPort;
+      SockStops = Fake::Stops;
+    }
+    bool keep = false;
+    if (sendAll(Sock, msg)) {
+      status = Response(Sock).read(reply, &keep);
+    }
+    if (!keep || status < 0) {
+      closeSession();
+    }
+    if (!reused) {
+      break;
+    }
+  }
+  uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+  bool failed = status != httpOK && (status < 300 || status >= 400); // Redirects are not failures.
+  if (status == httpOK) {
+    size_t er = reply->find("\"er\":\"");
+    failed = er != std::string::npos && (*reply)[er + 6] != '"';
+  }
+  record(requestType(path), failed, latency, msg.size());
+  return status;
+}
+
+// binaryReader reads B0 as slowly varying 16-bit samples, with noise.
+int binaryReader(Pin * pin) {
+  static long phase = 0;
+  if (strcmp(pin->name, "B0") != 0) {
+    return -1;
+  }
+  for (int ii = 0; ii + 1 < BinarySize; ii += 2, phase++) {
+    int16_t val = (int16_t)(1000 * sin(phase / 500.0)) + random() % 16;
+    memcpy(Binary + ii, &val, 2);
+  }
+  pin->value = BinarySize;
+  pin->data = Binary;
+  return pin->value;
+}
+
+// device runs the virtual device with the given index until killed,
+// writing the outcome of each request to the stats pipe.
+void device(const Params& params, int index) {
+  Fake::reset();
+  Fake::RealTime = true;
+  Fake::Service = forward;
+  Fake::OnReset = onReset;
+  Fake::Verbose = params.verbose && index == 0;
+  Fake::Mac[0] = params.mac[0];
+  Fake::Mac[1] = params.mac[1];
+  for (int ii = 0; ii < 4; ii++) {
+    Fake::Mac[2 + ii] = index >> (24 - 8 * ii);
+  }
+  srandom(params.seed + index);
+  BinarySize = params.binary;
+  BinaryReader = binaryReader;
+
+  // Configure the device, as if by an earlier config request.
+  readConfig(&Config);
+  snprintf(Config.dkey, DKEY_SIZE, "%lld", params.dkey + index);
+  padCopy(Config.wifi, DEFAULT_WIFI, WIFI_SIZE);
+  padCopy(Config.inputs, params.inputs.c_str(), IO_SIZE);
+  padCopy(Config.outputs, params.outputs.c_str(), IO_SIZE);
+  Config.monPeriod = params.monPeriod;
+  Config.actPeriod = params.actPeriod;
+  Config.format = params.compact ? wireCompact : wireText;
+  Config.vars[pvCompression] = params.lz4 ? encodeLz4 : 0;
+  writeConfig(&Config);
+
+  for (;;) {
+    init();
+    Debug = Fake::Verbose;
+    int varsum = 0;
+    try {
+      for (;;) {
+        run(&varsum);
+      }
+    } catch (const Reboot& reboot) {
+      Fake::ResetReason = reboot.reason;
+    }
+    // Reset the state that the ESP loses upon reset and that affects requests.
+    closeSession();
+    WiFi.disconnect();
+    Time = 0;
+    Configured = false;
+    VarSum = 0;
+  }
+}
+
+// percentile returns the p'th percentile of sorted latencies, in milliseconds.
+double percentile(const std::vector<uint32_t>& latencies, int pc) {
+  if (latencies.empty()) {
+    return 0;
+  }
+  return latencies[(latencies.size() - 1) * pc / 100] / 1000.0;
+}
+
+static volatile sig_atomic_t Interrupted = 0;
+
+void onInterrupt(int) {
+  Interrupted = 1;
+}
+
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+// Collector accumulates the records that devices write to the stats pipe.
+class Collector {
+public:
+  Collector(int fd, int period) : _fd(fd), _period(period), _bytes(0), _stats() {
+    _start = std::chrono::steady_clock::now();
+    _next = _start + std::chrono::seconds(period);
+  }
+
+  // wait collects records until the deadline, writing a report every
+  // period, returning false if interrupted or the pipe is closed.
+  bool wait(TimePoint deadline) {
+    while (_period > 0 && _next < deadline) {
+      if (!collect(_next)) {
+        return false;
+      }
+      report(_next);
+      printf("\n");
+      _next += std::chrono::seconds(_period);
+    }
+    return collect(deadline);
+  }
+
+  // drain collects the remaining records, until the pipe is closed.
+  void drain() {
+    while (collect(std::chrono::steady_clock::now() + std::chrono::seconds(1))) {
+      ;
+    }
+  }
+
+  // report writes latency percentiles, throughput and error rates accumulated from the start until now.
+  void report(TimePoint now) {
+    double elapsed = std::chrono::duration<double>(now - _start).count();
+    printf("%-8s %9s %9s %9s %9s %9s %8s\n", "request", "count", "errors", "err%", "p50(ms)", "p99(ms)", "req/s");
+    long total = 0, errors = 0;
+    for (int ii = 0; ii < loadTypes; ii++) {
+      Stats * stats = &_stats[ii];
+      long count = stats->latencies.size() + stats->errors;
+      total += count;
+      errors += stats->errors;
+      if (count == 0) {
+        continue;
+      }
+      std::sort(stats->latencies.begin(), stats->latencies.end());
+      printf("%-8s %9ld %9ld %9.2f %9.1f %9.1f %8.1f\n", LoadNames[ii], count, stats->errors, 100.0 * stats->errors / count,
+             percentile(stats->latencies, 50), percentile(stats->latencies, 99), count / elapsed);
+    }
+    if (total > 0) {
+      printf("%-8s %9ld %9ld %9.2f %9s %9s %8.1f (%.1f kB/s sent)\n", "total", total, errors,
+             100.0 * errors / total, "", "", total / elapsed, _bytes / elapsed / 1000);
+    }
+    fflush(stdout);
+  }
+
+private:
+  // collect reads records until the deadline, returning false if interrupted or the pipe is closed.
+  bool collect(TimePoint deadline) {
+    for (;;) {
+      if (Interrupted) {
+        return false;
+      }
+      long ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (ms <= 0) {
+        return true;
+      }
+      struct pollfd pfd = {_fd, POLLIN, 0};
+      if (poll(&pfd, 1, ms) <= 0) {
+        continue; // Timed out or interrupted.
+      }
+      Record recs[256];
+      ssize_t nn = read(_fd, recs, sizeof(recs));
+      if (nn < 0 && errno == EINTR) {
+        continue;
+      }
+      if (nn <= 0) {
+        return false;
+      }
+      for (size_t ii = 0; ii < nn / sizeof(Record); ii++) {
+        Record * rec = &recs[ii];
+        if (rec->type >= loadTypes) {
+          continue;
+        }
+        if (rec->failed) {
+          _stats[rec->type].errors++;
+        } else {
+          _stats[rec->type].latencies.push_back(rec->latency);
+        }
+        _bytes += rec->bytes;
+      }
+    }
+  }
+
+  int _fd;
+  int _period;
+  uint64_t _bytes;
+  Stats _stats[loadTypes];
+  TimePoint _start;
+  TimePoint _next;
+};
+
+// usage writes the usage and exits.
+void usage() {
+  fprintf(stderr, "Usage: load-netsender [-url URL] [-devices N] [-duration s] [-ramp s] [-report s]\n"
+                  "         [-inputs pins] [-outputs pins] [-mp s] [-ap s] [-binary bytes] [-compact] [-lz4]\n"
+                  "         [-mac prefix] [-dkey base] [-seed N] [-v]\n");
+  exit(1);
+}
+
+int main(int argc, char ** argv) {
+  Params params = {"http://localhost:8080", 100, 300, 10, 30, "A0,X10", "D0", 60, 60, 0, false, false, {0x0A, 0x4C}, 10000000000LL, 1, false};
+  for (int ii = 1; ii < argc; ii++) {
+    const char * flag = argv[ii];
+    if (strcmp(flag, "-compact") == 0) {
+      params.compact = true;
+      continue;
+    } else if (strcmp(flag, "-lz4") == 0) {
+      params.lz4 = true;
+      continue;
+    } else if (strcmp(flag, "-v") == 0) {
+      params.verbose = true;
+      continue;
+    }
+    if (ii + 1 >= argc) {
+      usage();
+    }
+    const char * arg = argv[++ii];
+    if (strcmp(flag, "-url") == 0) {
+      params.url = arg;
+    } else if (strcmp(flag, "-devices") == 0) {
+      params.devices = atoi(arg);
+    } else if (strcmp(flag, "-duration") == 0) {
+      params.duration = atoi(arg);
+    } else if (strcmp(flag, "-ramp") == 0) {
+      params.ramp = atoi(arg);
+    } else if (strcmp(flag, "-report") == 0) {
+      params.report = atoi(arg);
+    } else if (strcmp(flag, "-inputs") == 0) {
+      params.inputs = arg;
+    } else if (strcmp(flag, "-outputs") == 0) {
+      params.outputs = arg;
+    } else if (strcmp(flag, "-mp") == 0) {
+      params.monPeriod = atoi(arg);
+    } else if (strcmp(flag, "-ap") == 0) {
+      params.actPeriod = atoi(arg);
+    } else if (strcmp(flag, "-binary") == 0) {
+      params.binary = atoi(arg);
+    } else if (strcmp(flag, "-mac") == 0) {
+      if (sscanf(arg, "%x:%x", &params.mac[0], &params.mac[1]) != 2 || params.mac[0] > 0xFF || params.mac[1] > 0xFF) {
+        usage();
+      }
+    } else if (strcmp(flag, "-dkey") == 0) {
+      params.dkey = atoll(arg);
+    } else if (strcmp(flag, "-seed") == 0) {
+      params.seed = atol(arg);
+    } else {
+      usage();
+    }
+  }
+
+  std::string host, port, path;
+  if (!splitURL(params.url, &host, &port, &path) || path != "/") {
+    fprintf(stderr, "URL must be an http service URL without a path\n");
+    exit(1);
+  }
+  while (!params.url.empty() && params.url.back() == '/') {
+    params.url.pop_back();
+  }
+  if (params.devices <= 0 || params.duration <= 0 || params.ramp < 0 || params.report < 0 ||
+      params.monPeriod <= 0 || params.actPeriod <= 0 || params.actPeriod > params.monPeriod ||
+      params.binary < 0 || params.binary > MAX_BINARY) {
+    fprintf(stderr, "invalid devices, duration, ramp, report, mp, ap or binary\n");
+    exit(1);
+  }
+  if (params.binary > 0 && ("," + params.inputs + ",").find(",B0,") == std::string::npos) {
+    params.inputs += params.inputs.empty() ? "B0" : ",B0";
+  }
+
+  printf("load-netsender: %d devices against %s for %ds\n", params.devices, params.url.c_str(), params.duration);
+  fflush(stdout); // Before forking.
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  signal(SIGINT, onInterrupt);
+
+  Collector collector(fds[0], params.report);
+  TimePoint start = std::chrono::steady_clock::now();
+  TimePoint end = start + std::chrono::seconds(params.duration);
+  std::vector<pid_t> pids;
+  bool ok = true;
+  for (int ii = 0; ok && ii < params.devices; ii++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      break;
+    }
+    if (pid == 0) {
+      signal(SIGINT, SIG_IGN); // The generator stops the devices.
+      close(fds[0]);
+      StatsPipe = fds[1];
+      Target = params.url;
+      device(params, ii);
+      _exit(0);
+    }
+    pids.push_back(pid);
+    // Devices are started evenly over the ramp period.
+    TimePoint started = start + std::chrono::microseconds(params.ramp * 1000000LL * (ii + 1) / params.devices);
+    ok = collector.wait(std::min(started, end)) && started < end;
+  }
+  close(fds[1]);
+  if (ok) {
+    collector.wait(end);
+  }
+  TimePoint stopped = std::min(std::chrono::steady_clock::now(), end);
+
+  // Stop the devices, then collect what they sent before they stopped.
+  for (pid_t pid : pids) {
+    kill(pid, SIGTERM);
+  }
+  for (pid_t pid : pids) {
+    waitpid(pid, NULL, 0);
+  }
+  Interrupted = 0;
+  collector.drain();
+  collector.report(stopped);
+  return 0;
+}
@@ -0,0 +1,531 @@
+/*
+  Name:
+    nonarduino - host fakes of the Arduino and ESP APIs used by NetSender.
+
+  Description:
+    The fakes behave just enough like the real thing for NetSender to
+    run on the host against a fake service, with a mock clock that only
+    advances when NetSender delays or sleeps, unless it follows the
+    host's clock in real time. Flash behaves as NOR
+    flash, i.e., writes can only clear bits until the sector is erased.
+
+  License:
+    Copyright (C) 2026 The Australian Ocean Lab (AusOcean).
+
+    This file is part of NetSender. NetSender is free software: you can
+    redistribute it and/or modify it under the terms of the GNU
+    General Public License as published by the Free Software
+    Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    NetSender is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetSender in gpl.txt.  If not, see
+    <http://www.gnu.org/licenses/>.
+*/
+
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "fakes.h"
+
+#define FLASH_SIZE   4096 // Size of the fake flash, i.e., the journal sector.
+#define RTC_SIZE     512  // Size of the fake RTC user memory.
+#define FLASH_OFFSET 0x40200000 // Address at which flash is mapped.
+
+// Globals.
+SerialType Serial;
+WiFiClient WiFi;
+ESPType ESP;
+EEPROMType EEPROM;
+FS LittleFS;
+
+// The journal lives at _EEPROM_start, which is sector aligned, as on the ESP.
+extern "C" {
+alignas(FLASH_SIZE) uint32_t _EEPROM_start;
+}
+
+namespace Fake {
+
+ServiceFunc Service = NULL;
+std::string Date;
+std::string Location;
+uint64_t Clock = 1000000; // NB: Time 0 is special to NetSender.
+bool RealTime = false;
+unsigned long AssociateTime = 200;
+unsigned long DhcpTime = 50;
+uint32_t ResetReason = 0;
+int AnalogValue = 512;
+int DeepSleeps = 0;
+int Restarts = 0;
+int Stops = 0;
+uint8_t Mac[6] = {0x0A, 0x4E, 0x53, 0x00, 0x00, 0x01};
+bool Verbose = false;
+ResetFunc OnReset = NULL;
+
+static unsigned char Flash[FLASH_SIZE];
+static unsigned char Rtc[RTC_SIZE];
+static std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> Files;
+static int64_t HostOffset = 0; // Clock less the host's clock, when following it.
+static bool Following = false; // True once HostOffset is set.
+
+// tickers returns the tickers, which are constructed on first use,
+// since tickers may be constructed before this file's globals.
+static std::vector<Ticker*>& tickers() {
+  static std::vector<Ticker*> tickers;
+  return tickers;
+}
+
+// WiFi state.
+static bool Associating = false;
+static int WifiStatus = WL_DISCONNECTED;
+static uint64_t WifiBegun = 0;
+static std::string Ssid;
+static void (*OnConnected)(const WiFiEventStationModeConnected&) = NULL;
+static void (*OnGotIP)(const WiFiEventStationModeGotIP&) = NULL;
+static bool Connected = false;
+
+void reset() {
+  memset(Flash, 0xFF, sizeof(Flash));
+  memset(Rtc, 0, sizeof(Rtc));
+  Files.clear();
+  Service = NULL;
+  Date.clear();
+  Location.clear();
+  RealTime = false;
+  AssociateTime = 200;
+  DhcpTime = 50;
+  ResetReason = 0;
+  AnalogValue = 512;
+  DeepSleeps = 0;
+  Restarts = 0;
+  Stops = 0;
+  const uint8_t mac[6] = {0x0A, 0x4E, 0x53, 0x00, 0x00, 0x01};
+  memcpy(Mac, mac, 6);
+  OnReset = NULL;
+  Associating = false;
+  WifiStatus = WL_DISCONNECTED;
+  Ssid.clear();
+  Connected = false;
+}
+
+// steadyClock returns the host's monotonic clock in microseconds.
+static uint64_t steadyClock() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+// sync advances the clock to the host's clock when in real time.
+// NB: Tickers only fire when the clock is advanced by advance.
+static void sync() {
+  if (!RealTime) {
+    Following = false;
+    return;
+  }
+  if (!Following) {
+    HostOffset = Clock - steadyClock();
+    Following = true;
+  }
+  Clock = std::max(Clock, steadyClock() + HostOffset);
+}
+
+// sleepUntil sleeps until the host's clock reaches the given mock time, when in real time.
+static void sleepUntil(uint64_t time) {
+  if (!RealTime) {
+    return;
+  }
+  uint64_t now = steadyClock() + HostOffset;
+  if (time > now) {
+    std::this_thread::sleep_for(std::chrono::microseconds(time - now));
+  }
+}
+
+void advance(uint64_t us) {
+  sync();
+  uint64_t target = Clock + us;
+  for (;;) {
+    Ticker * due = NULL;
+    for (Ticker * ticker : tickers()) {
+      if (ticker->_func != NULL && ticker->_deadline <= target && (due == NULL || ticker->_deadline < due->_deadline)) {
+        due = ticker;
+      }
+    }
+    sleepUntil(due == NULL ? target : due->_deadline);
+    if (due == NULL) {
+      break;
+    }
+    Clock = std::max(Clock, due->_deadline);
+    void (*func)() = due->_func;
+    due->_func = NULL; // Once only, unless rearmed by the callback.
+    func();
+  }
+  Clock = target;
+}
+
+// flashIndex returns the index into Flash of a flash address, or -1 if
+// size bytes from it are outside the journal sector.
+static long flashIndex(uint32_t address, size_t size) {
+  uint32_t base = (uint32_t)((uintptr_t)&_EEPROM_start - FLASH_OFFSET);
+  if (address < base || address - base + size > FLASH_SIZE) {
+    return -1;
+  }
+  return address - base;
+}
+
+} // end namespace
+
+// IPAddress.
+IPAddress::IPAddress() : _addr(0) {}
+IPAddress::IPAddress(uint32_t addr) : _addr(addr) {}
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _addr(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+IPAddress::operator uint32_t() const { return _addr; }
+uint8_t IPAddress::operator[](int ii) const { return (_addr >> (ii * 8)) & 0xFF; }
+
+// String.
+String::String() {}
+String::String(const char * str) : _s(str) {}
+String::String(int val) : _s(std::to_string(val)) {}
+String String::operator+(const String& str) const { String ss(*this); ss._s += str._s; return ss; }
+String String::operator+(const char * str) const { String ss(*this); ss._s += str; return ss; }
+String& String::operator+=(const String& str) { _s += str._s; return *this; }
+String& String::operator+=(const char * str) { _s += str; return *this; }
+String& String::operator+=(char ch) { _s += ch; return *this; }
+String& String::operator+=(int val) { _s += std::to_string(val); return *this; }
+bool String::operator==(const char * str) const { return _s == str; }
+bool String::operator!=(const char * str) const { return _s != str; }
+bool String::operator==(const String& str) const { return _s == str._s; }
+bool String::operator!=(const String& str) const { return _s != str._s; }
+int String::indexOf(const String& str) const { size_t pos = _s.find(str._s); return pos == std::string::npos ? -1 : pos; }
+int String::indexOf(char ch, int from) const { size_t pos = _s.find(ch, from); return pos == std::string::npos ? -1 : pos; }
+int String::charAt(int ii) const { return ii < (int)_s.size() ? _s[ii] : 0; }
+int String::length() const { return _s.size(); }
+String String::substring(int from) const { String ss; ss._s = from < (int)_s.size() ? _s.substr(from) : ""; return ss; }
+String String::substring(int from, int to) const { String ss; ss._s = from < (int)_s.size() ? _s.substr(from, to - from) : ""; return ss; }
+String String::trim() {
+  size_t start = _s.find_first_not_of(" \t\r\n");
+  size_t end = _s.find_last_not_of(" \t\r\n");
+  _s = start == std::string::npos ? "" : _s.substr(start, end - start + 1);
+  return *this;
+}
+bool String::startsWith(String str) const { return _s.compare(0, str._s.size(), str._s) == 0; }
+const char* String::c_str() const { return _s.c_str(); }
+int String::toInt() const { return atoi(_s.c_str()); }
+
+// Serial, which writes to stdout when verbose.
+void SerialType::begin() {}
+void SerialType::begin(int) {}
+void SerialType::print(const char * str) { if (Fake::Verbose) fputs(str, stdout); }
+void SerialType::print(const byte * str) { print((const char *)str); }
+void SerialType::print(int val) { if (Fake::Verbose) printf("%d", val); }
+void SerialType::print(unsigned int val) { if (Fake::Verbose) printf("%u", val); }
+void SerialType::print(long val) { if (Fake::Verbose) printf("%ld", val); }
+void SerialType::print(unsigned long val) { if (Fake::Verbose) printf("%lu", val); }
+void SerialType::println(const char * str) { print(str), print("\n"); }
+void SerialType::println(const byte * str) { print(str), print("\n"); }
+void SerialType::println(int val) { print(val), print("\n"); }
+void SerialType::println(unsigned int val) { print(val), print("\n"); }
+void SerialType::println(long val) { print(val), print("\n"); }
+void SerialType::println(unsigned long val) { print(val), print("\n"); }
+void SerialType::print(String str) { print(str.c_str()); }
+void SerialType::println(String str) { println(str.c_str()); }
+void SerialType::print(IPAddress ip) { if (Fake::Verbose) printf("%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]); }
+void SerialType::println(IPAddress ip) { print(ip), print("\n"); }
+size_t SerialType::write(const uint8_t * data, size_t size) { if (Fake::Verbose) fwrite(data, 1, size, stdout); return size; }
+void SerialType::flush() { if (Fake::Verbose) fflush(stdout); }
+
+// Ticker, which fires as the mock clock advances.
+Ticker::Ticker() : _func(NULL), _deadline(0) { Fake::tickers().push_back(this); }
+Ticker::~Ticker() { Fake::tickers().erase(std::find(Fake::tickers().begin(), Fake::tickers().end(), this)); }
+void Ticker::once_ms(uint32_t ms, void (*func)()) { _func = func; _deadline = Fake::Clock + ms * 1000ULL; }
+void Ticker::detach() { _func = NULL; }
+
+// ESP.
+void ESPType::restart() {
+  Fake::Restarts++;
+  if (Fake::OnReset != NULL) {
+    Fake::OnReset(REASON_SOFT_RESTART);
+  }
+}
+rst_info* ESPType::getResetInfoPtr() { static rst_info info; info.reason = Fake::ResetReason; return &info; }
+uint32_t ESPType::random() { return ::random(); }
+// deepSleep advances the clock, then returns, unlike the ESP, unless OnReset does not.
+void ESPType::deepSleep(uint64_t us) {
+  Fake::DeepSleeps++;
+  Fake::advance(us);
+  if (Fake::OnReset != NULL) {
+    Fake::OnReset(REASON_DEEP_SLEEP_AWAKE);
+  }
+}
+
+bool ESPType::flashEraseSector(uint32_t sector) {
+  long ii = Fake::flashIndex(sector * FLASH_SIZE, FLASH_SIZE);
+  if (ii < 0) {
+    return false;
+  }
+  memset(Fake::Flash + ii, 0xFF, FLASH_SIZE);
+  return true;
+}
+
+bool ESPType::flashWrite(uint32_t address, const uint32_t * data, size_t size) {
+  long ii = Fake::flashIndex(address, size);
+  if (ii < 0 || address % 4 != 0 || size % 4 != 0) {
+    return false;
+  }
+  for (size_t jj = 0; jj < size; jj++) {
+    Fake::Flash[ii + jj] &= ((const unsigned char *)data)[jj];
+  }
+  return true;
+}
+
+bool ESPType::flashRead(uint32_t address, uint32_t * data, size_t size) {
+  long ii = Fake::flashIndex(address, size);
+  if (ii < 0 || address % 4 != 0) {
+    return false;
+  }
+  memcpy(data, Fake::Flash + ii, size);
+  return true;
+}
+
+bool ESPType::rtcUserMemoryRead(uint32_t offset, uint32_t * data, size_t size) {
+  if (offset * 4 + size > RTC_SIZE) {
+    return false;
+  }
+  memcpy(data, Fake::Rtc + offset * 4, size);
+  return true;
+}
+
+bool ESPType::rtcUserMemoryWrite(uint32_t offset, uint32_t * data, size_t size) {
+  if (offset * 4 + size > RTC_SIZE) {
+    return false;
+  }
+  memcpy(Fake::Rtc + offset * 4, data, size);
+  return true;
+}
+
+// EEPROM, which NetSender no longer uses.
+void EEPROMType::begin(int) {}
+unsigned char EEPROMType::read(int) { return 0xFF; }
+void EEPROMType::write(int, const unsigned char) {}
+void EEPROMType::commit() {}
+void EEPROMType::put(int, void*) {}
+
+// WiFi, which associates then obtains an address after the configured mock times.
+WiFiEventHandler WiFiClient::onStationModeConnected(void (*func)(const WiFiEventStationModeConnected&)) { Fake::OnConnected = func; return (WiFiEventHandler)func; }
+WiFiEventHandler WiFiClient::onStationModeGotIP(void (*func)(const WiFiEventStationModeGotIP&)) { Fake::OnGotIP = func; return (WiFiEventHandler)func; }
+void WiFiClient::begin() { begin(Fake::Ssid.c_str(), ""); }
+void WiFiClient::begin(const char * ssid, const char *) {
+  Fake::Ssid = ssid;
+  Fake::Associating = true;
+  Fake::Connected = false;
+  Fake::WifiStatus = WL_DISCONNECTED;
+  Fake::WifiBegun = Fake::Clock;
+}
+void WiFiClient::begin(const char * ssid, const char * key, int, const uint8_t*) { begin(ssid, key); }
+bool WiFiClient::config(IPAddress, IPAddress, IPAddress) { return true; }
+bool WiFiClient::config(IPAddress, IPAddress, IPAddress, IPAddress) { return true; }
+uint8_t* WiFiClient::BSSID() { static uint8_t bssid[6] = {0x02, 0, 0, 0, 0, 1}; return bssid; }
+int WiFiClient::channel() { return 6; }
+IPAddress WiFiClient::gatewayIP() { return IPAddress(10, 0, 0, 1); }
+IPAddress WiFiClient::subnetMask() { return IPAddress(255, 255, 255, 0); }
+IPAddress WiFiClient::dnsIP() { return IPAddress(10, 0, 0, 1); }
+
+int WiFiClient::status() {
+  if (Fake::Associating) {
+    uint64_t elapsed = (Fake::Clock - Fake::WifiBegun) / 1000;
+    if (!Fake::Connected && elapsed >= Fake::AssociateTime) {
+      Fake::Connected = true;
+      if (Fake::OnConnected != NULL) {
+        Fake::OnConnected(WiFiEventStationModeConnected());
+      }
+    }
+    if (Fake::Connected && elapsed >= Fake::AssociateTime + Fake::DhcpTime) {
+      Fake::Associating = false;
+      Fake::WifiStatus = WL_CONNECTED;
+      if (Fake::OnGotIP != NULL) {
+        Fake::OnGotIP(WiFiEventStationModeGotIP());
+      }
+    }
+  }
+  return Fake::WifiStatus;
+}
+
+int WiFiClient::mode(int) { return 1; }
+bool WiFiClient::connect(const char*, int) { return Fake::WifiStatus == WL_CONNECTED; }
+uint8_t WiFiClient::connected() { return Fake::WifiStatus == WL_CONNECTED; }
+int WiFiClient::available() { return 0; }
+int WiFiClient::read() { return -1; }
+bool WiFiClient::persistent(bool) { return true; }
+String WiFiClient::SSID() { return String(Fake::Ssid.c_str()); }
+int WiFiClient::read(unsigned char*, size_t) { return 0; }
+int WiFiClient::write(const unsigned char*, size_t size) { return size; }
+String WiFiClient::readStringUntil(int) { return String(); }
+void WiFiClient::print(String) {}
+void WiFiClient::print(const char*) {}
+void WiFiClient::disconnect() { Fake::Associating = false; Fake::Connected = false; Fake::WifiStatus = WL_DISCONNECTED; }
+IPAddress WiFiClient::localIP() { return Fake::WifiStatus == WL_CONNECTED ? IPAddress(10, 0, 0, 2) : IPAddress(); }
+void WiFiClient::macAddress(byte mac[6]) { memcpy(mac, Fake::Mac, 6); }
+void WiFiClient::stop() { Fake::Stops++; }
+
+// HTTPClient, which sends requests to Fake::Service.
+void HTTPClient::setTimeout(unsigned long) {}
+void HTTPClient::setReuse(bool) {}
+void HTTPClient::begin(WiFiClient& client, String url) { _client = &client; _url = url.c_str(); }
+void HTTPClient::begin(WiFiClient& client, const char * url) { _client = &client; _url = url; }
+void HTTPClient::addHeader(const char * name, const char * value) {
+  if (strcmp(name, "Content-Type") == 0) {
+    _type = value;
+  } else if (strcmp(name, "Content-Encoding") == 0) {
+    _encoding = value;
+  }
+}
+void HTTPClient::collectHeaders(const char*[], int) {}
+String HTTPClient::header(const char * name) {
+  if (strcmp(name, "Date") == 0) {
+    return String(Fake::Date.c_str());
+  }
+  return String(strcmp(name, "Location") == 0 ? Fake::Location.c_str() : "");
+}
+int HTTPClient::GET() { return send("GET", ""); }
+int HTTPClient::POST(String body) { return send("POST", body.c_str()); }
+int HTTPClient::POST(const uint8_t * body, size_t size) { return send("POST", std::string((const char *)body, size)); }
+
+int HTTPClient::sendRequest(const char * method, Stream * stream, size_t size) {
+  std::string body;
+  while (body.size() < size && stream->available() > 0) {
+    if (stream->hasPeekBufferAPI()) {
+      size_t nn = std::min(stream->peekAvailable(), size - body.size());
+      body.append(stream->peekBuffer(), nn);
+      stream->peekConsume(nn);
+    } else {
+      body += (char)stream->read();
+    }
+  }
+  if (body.size() != size) {
+    return -3; // HTTPC_ERROR_SEND_PAYLOAD_FAILED.
+  }
+  return send(method, body);
+}
+
+int HTTPClient::send(const char * method, const std::string& body) {
+  _reply.clear();
+  if (Fake::Service == NULL || WiFi.status() != WL_CONNECTED) {
+    return -1; // HTTPC_ERROR_CONNECTION_FAILED.
+  }
+  Fake::Request req = {method, _url, body, _type, _encoding};
+  _client->available(); // As the ESP client polls while awaiting the reply.
+  return Fake::Service(req, &_reply);
+}
+
+String HTTPClient::getString() { return String(_reply.c_str()); }
+
+int HTTPClient::writeToStream(Stream * stream) {
+  if (stream->write((const uint8_t *)_reply.data(), _reply.size()) != _reply.size()) {
+    return -10; // HTTPC_ERROR_STREAM_WRITE.
+  }
+  return _reply.size();
+}
+
+void HTTPClient::end() {
+  _type.clear();
+  _encoding.clear();
+}
+
+// File and FS, which hold files in memory.
+File::File() : _pos(0) {}
+
+size_t File::write(const uint8_t * data, size_t size) {
+  if (!_data) {
+    return 0;
+  }
+  _data->insert(_data->end(), data, data + size); // NB: Files are only ever appended.
+  _pos = _data->size();
+  return size;
+}
+
+size_t File::read(uint8_t * data, size_t size) {
+  if (!_data || _pos >= _data->size()) {
+    return 0;
+  }
+  size = std::min(size, _data->size() - _pos);
+  memcpy(data, _data->data() + _pos, size);
+  _pos += size;
+  return size;
+}
+
+bool File::seek(uint32_t pos) {
+  if (!_data || pos > _data->size()) {
+    return false;
+  }
+  _pos = pos;
+  return true;
+}
+
+size_t File::size() { return _data ? _data->size() : 0; }
+void File::close() { _data.reset(); }
+File::operator bool() const { return (bool)_data; }
+
+bool FS::begin() { return true; }
+
+File FS::open(const char * path, const char * mode) {
+  File file;
+  auto it = Fake::Files.find(path);
+  if (mode[0] == 'r') {
+    if (it != Fake::Files.end()) {
+      file._data = it->second;
+    }
+    return file;
+  }
+  if (it == Fake::Files.end() || mode[0] == 'w') {
+    Fake::Files[path] = std::make_shared<std::vector<uint8_t>>();
+  }
+  file._data = Fake::Files[path];
+  file._pos = file._data->size();
+  return file;
+}
+
+bool FS::exists(const char * path) { return Fake::Files.count(path) > 0; }
+bool FS::remove(const char * path) { return Fake::Files.erase(path) > 0; }
+
+bool FS::rename(const char * from, const char * to) {
+  auto it = Fake::Files.find(from);
+  if (it == Fake::Files.end()) {
+    return false;
+  }
+  Fake::Files[to] = it->second;
+  Fake::Files.erase(from);
+  return true;
+}
+
+// Functions.
+void pinMode(int, int) {}
+int analogRead(int) { return Fake::AnalogValue; }
+void analogWrite(int, int) {}
+int digitalRead(int) { return LOW; }
+void digitalWrite(int, int) {}
+
+unsigned long millis() { Fake::sync(); return Fake::Clock / 1000; }
+unsigned long micros() { Fake::sync(); return Fake::Clock; }
+
+void timer1_attachInterrupt(void (*)()) {}
+void timer1_detachInterrupt() {}
+void timer1_enable(int, int, int) {}
+void timer1_disable() {}
+void timer1_write(uint32_t) {}
+void delay(unsigned long ms) { Fake::advance(ms * 1000ULL); }
+void yield() { Fake::advance(0); }
+int random(int max) { return ::random() % max; }
+
+void wifi_set_opmode(int) {}
+void wifi_set_sleep_type(int) {}
+void wifi_fpm_open() {}
+void wifi_fpm_close() {}
+void wifi_fpm_do_sleep(int) {}
+void wifi_fpm_do_wakeup() {}
+void wifi_station_connect() {}
+void wifi_station_disconnect() {}
+int wifi_station_get_connect_status() { return DHCP_STOPPED; }
@@ -1,15 +1,29 @@
-// Stub for compiling without Arduino.
-// Add an include to this file, comment out Arduino and ESP include files then run:
-// gcc -fpermissive -fsyntax-only -isystem . NetSender.cpp
+// Fakes for compiling without Arduino.
+// NetSender.cpp includes this file in place of the Arduino and ESP
+// include files when ARDUINO is not defined, so just run:
+// g++ -fsyntax-only -Wall -isystem . NetSender.cpp
+// The fakes are implemented by host/nonarduino.cpp, which, together
+// with host/fakes.h, provides a host build (see host/Makefile).
+// NB: Keep in sync with the Arduino and ESP APIs used by NetSender.cpp.
+
+#ifndef NonArduino_H
+#define NonArduino_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <memory>
 
 #define LOW 0
 #define HIGH 1
 #define F(x) x
+#define ICACHE_RAM_ATTR
 
 enum PinType {
   INPUT,
@@ -17,9 +31,37 @@ enum PinType {
 };
 
 // Types.
-typedef u_int8_t uint8_t;
 typedef unsigned char byte;
-typedef byte* IPAddress;
+
+class IPAddress {
+public:
+  IPAddress();
+  IPAddress(uint32_t);
+  IPAddress(uint8_t, uint8_t, uint8_t, uint8_t);
+  operator uint32_t() const;
+  uint8_t operator[](int) const;
+private:
+  uint32_t _addr; // First octet in the least significant byte, as per the ESP.
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t*, size_t) { return 0; }
+  virtual void flush() {}
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual bool hasPeekBufferAPI() const { return false; }
+  virtual size_t peekAvailable() { return 0; }
+  virtual const char* peekBuffer() { return NULL; }
+  virtual void peekConsume(size_t) {}
+};
 
 class String {
 public:
@@ -28,20 +70,26 @@ public:
   String(int);
   String operator+(const String&) const;
   String operator+(const char*) const;
-  String operator+=(const String&) const;
-  String operator+=(const char*) const;
-  bool operator==(const char*);
-  bool operator!=(const char*);
-  int indexOf(const String&);
-  int indexOf(char, int);
-  int charAt(int);
-  int length();
-  String substring(int);
-  String substring(int, int);
+  String& operator+=(const String&);
+  String& operator+=(const char*);
+  String& operator+=(char);
+  String& operator+=(int);
+  bool operator==(const char*) const;
+  bool operator!=(const char*) const;
+  bool operator==(const String&) const;
+  bool operator!=(const String&) const;
+  int indexOf(const String&) const;
+  int indexOf(char, int) const;
+  int charAt(int) const;
+  int length() const;
+  String substring(int) const;
+  String substring(int, int) const;
   String trim();
-  bool startsWith(String);
-  const char* c_str();
-  int toInt();
+  bool startsWith(String) const;
+  const char* c_str() const;
+  int toInt() const;
+private:
+  std::string _s;
 };
 
 class SerialType {
@@ -51,18 +99,51 @@ public:
   void print(const char*);
   void print(const byte*);
   void print(int);
+  void print(unsigned int);
+  void print(long);
+  void print(unsigned long);
   void println(const char*);
   void println(const byte*);
   void println(int);
+  void println(unsigned int);
+  void println(long);
+  void println(unsigned long);
   void print(String);
   void println(String);
+  void print(IPAddress);
+  void println(IPAddress);
+  size_t write(const uint8_t*, size_t);
   void flush();
 };
 
+#define REASON_SOFT_RESTART     4
+#define REASON_DEEP_SLEEP_AWAKE 5
+
+struct rst_info {
+  uint32_t reason;
+};
+
+class Ticker {
+public:
+  Ticker();
+  ~Ticker();
+  void once_ms(uint32_t, void (*)());
+  void detach();
+  void (*_func)();    // Callback, or NULL when detached.
+  uint64_t _deadline; // Mock time at which the callback is due.
+};
+
 class ESPType {
 public:
   void restart();
-  void deepSleep(unsigned int);
+  rst_info* getResetInfoPtr();
+  uint32_t random();
+  void deepSleep(uint64_t);
+  bool flashEraseSector(uint32_t);
+  bool flashWrite(uint32_t, const uint32_t*, size_t);
+  bool flashRead(uint32_t, uint32_t*, size_t);
+  bool rtcUserMemoryRead(uint32_t, uint32_t*, size_t);
+  bool rtcUserMemoryWrite(uint32_t, uint32_t*, size_t);
 };
 
 class EEPROMType {
@@ -75,18 +156,35 @@ public:
 };
 
 #define STATION_MODE 0
-#define WL_CONNECTED 1
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 7
 #define WIFI_STA 2
 
+struct WiFiEventStationModeConnected {};
+struct WiFiEventStationModeGotIP {};
+typedef void* WiFiEventHandler;
+
 class WiFiClient {
 public:
+  virtual ~WiFiClient() {}
+  WiFiEventHandler onStationModeConnected(void (*)(const WiFiEventStationModeConnected&));
+  WiFiEventHandler onStationModeGotIP(void (*)(const WiFiEventStationModeGotIP&));
   void begin();
   void begin(const char*, const char*);
+  void begin(const char*, const char*, int, const uint8_t*);
+  bool config(IPAddress, IPAddress, IPAddress);
+  bool config(IPAddress, IPAddress, IPAddress, IPAddress);
+  uint8_t* BSSID();
+  int channel();
+  IPAddress gatewayIP();
+  IPAddress subnetMask();
+  IPAddress dnsIP();
   int status();
   int mode(int);
   bool connect(const char*, int);
-  bool connected();
-  bool available();
+  virtual uint8_t connected();
+  virtual int available();
+  virtual int read();
   bool persistent(bool);
   String SSID();
   int read(unsigned char*, size_t);
@@ -103,14 +201,48 @@ public:
 class HTTPClient {
 public:
   void setTimeout(unsigned long);
+  void setReuse(bool);
   void begin(WiFiClient&, String);
+  void begin(WiFiClient&, const char*);
   void addHeader(const char*, const char*);
   void collectHeaders(const char* headerNames[], int);
   String header(const char*);
   int GET();
   int POST(String);
+  int POST(const uint8_t*, size_t);
+  int sendRequest(const char*, Stream*, size_t);
   String getString();
+  int writeToStream(Stream*);
   void end();
+private:
+  int send(const char*, const std::string&);
+  WiFiClient* _client;
+  std::string _url;
+  std::string _type;
+  std::string _encoding;
+  std::string _reply;
+};
+
+class File {
+public:
+  File();
+  size_t write(const uint8_t*, size_t);
+  size_t read(uint8_t*, size_t);
+  bool seek(uint32_t);
+  size_t size();
+  void close();
+  operator bool() const;
+  std::shared_ptr<std::vector<uint8_t>> _data; // File contents, shared with the file system.
+  size_t _pos;
+};
+
+class FS {
+public:
+  bool begin();
+  File open(const char*, const char*);
+  bool exists(const char*);
+  bool remove(const char*);
+  bool rename(const char*, const char*);
 };
 
 // Functions.
@@ -120,12 +252,20 @@ void analogWrite(int, int);
 int digitalRead(int);
 void digitalWrite(int, int);
 
-unsigned long millis(); 
+unsigned long millis();
+unsigned long micros();
+
+#define TIM_DIV16 1
+#define TIM_EDGE 0
+#define TIM_LOOP 1
+void timer1_attachInterrupt(void (*)());
+void timer1_detachInterrupt();
+void timer1_enable(int, int, int);
+void timer1_disable();
+void timer1_write(uint32_t);
 void delay(unsigned long);
 void yield();
 int random(int);
-  
-char* sprintf(const char*, ...);
 
 // Low-level WiFi functions.
 #define NULL_MODE 0
@@ -143,7 +283,10 @@ void wifi_station_disconnect();
 int wifi_station_get_connect_status();
 
 // Globals.
-SerialType Serial;
-WiFiClient WiFi;
-ESPType ESP;
-EEPROMType EEPROM;
+extern SerialType Serial;
+extern WiFiClient WiFi;
+extern ESPType ESP;
+extern EEPROMType EEPROM;
+extern FS LittleFS;
+
+#endif
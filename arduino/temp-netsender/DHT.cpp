@@ -7,18 +7,16 @@ written by Adafruit Industries
 #include "DHT.h"
 
 #define MIN_INTERVAL 2000
+#define START_DHT11  20000 // Start signal duration for the DHT11 in microseconds.
+#define START_DHT22  1100  // Start signal duration for the DHT21/22 in microseconds.
+#define FRAME_PERIOD 6000  // Time allowed for the sensor to send a frame in microseconds.
 
 DHT::DHT(uint8_t pin, uint8_t type, uint8_t count) {
   _pin = pin;
   _type = type;
-  #ifdef __AVR
-    _bit = digitalPinToBitMask(pin);
-    _port = digitalPinToPort(pin);
-  #endif
-  _maxcycles = microsecondsToClockCycles(1000);  // 1 millisecond timeout for
-                                                 // reading pulses from DHT sensor.
-  // Note that count is now ignored as the DHT reading algorithm adjusts itself
-  // basd on the speed of the processor.
+  _state = idle;
+  _lastresult = false;
+  // Note that count is now ignored as pulses are timed by interrupts.
 }
 
 void DHT::begin(void) {
@@ -28,7 +26,6 @@ void DHT::begin(void) {
   // >= MIN_INTERVAL right away. Note that this assignment wraps around,
   // but so will the subtraction.
   _lastreadtime = -MIN_INTERVAL;
-  DEBUG_PRINT("Max clock cycles: "); DEBUG_PRINTLN(_maxcycles, DEC);
 }
 
 //boolean S == Scale.  True == Fahrenheit; False == Celcius
@@ -121,90 +118,112 @@ float DHT::computeHeatIndex(float temperature, float percentHumidity, bool isFah
 }
 
 boolean DHT::read(bool force) {
+  // Finish a read already in progress.
+  if (_state != idle) {
+    while (!ready()) {
+      yield();
+    }
+    return _lastresult;
+  }
+
   // Check if sensor was read less than two seconds ago and return early
   // to use last reading.
   uint32_t currenttime = millis();
-  if (!force && ((currenttime - _lastreadtime) < 2000)) {
+  if (!force && ((currenttime - _lastreadtime) < MIN_INTERVAL)) {
     return _lastresult; // return last correct measurement
   }
-  _lastreadtime = currenttime;
-
-  // Reset 40 bits of received data to zero.
-  data[0] = data[1] = data[2] = data[3] = data[4] = 0;
 
-  // Send start signal.  See DHT datasheet for full signal diagram:
-  //   http://www.adafruit.com/datasheets/Digital%20humidity%20and%20temperature%20sensor%20AM2302.pdf
+  start();
+  while (!ready()) {
+    yield();
+  }
+  return _lastresult;
+}
 
-  // Go into high impedence state to let pull-up raise data line level and
-  // start the reading process.
-  digitalWrite(_pin, HIGH);
-  delay(250);
+// start starts a read, without blocking. See DHT datasheet for full signal diagram:
+//   http://www.adafruit.com/datasheets/Digital%20humidity%20and%20temperature%20sensor%20AM2302.pdf
+void DHT::start(void) {
+  if (_state != idle) {
+    return;
+  }
+  _lastreadtime = millis();
 
-  // First set data line low for 20 milliseconds.
+  // Set the data line low to send the start signal, which ends in ready.
   pinMode(_pin, OUTPUT);
   digitalWrite(_pin, LOW);
-  delay(20);
-
-  uint32_t cycles[80];
-  {
-    // Turn off interrupts temporarily because the next sections are timing critical
-    // and we don't want any interruptions.
-    InterruptLock lock;
-
-    // End the start signal by setting data line high for 40 microseconds.
-    digitalWrite(_pin, HIGH);
-    delayMicroseconds(40);
-
-    // Now start reading the data line to get the value from the DHT sensor.
-    pinMode(_pin, INPUT_PULLUP);
-    delayMicroseconds(10);  // Delay a bit to let sensor pull data line low.
+  _starttime = micros();
+  _state = starting;
+}
 
-    // First expect a low signal for ~80 microseconds followed by a high signal
-    // for ~80 microseconds again.
-    if (expectPulse(LOW) == 0) {
-      DEBUG_PRINTLN(F("Timeout waiting for start signal low pulse."));
-      _lastresult = false;
-      return _lastresult;
+// ready returns true once a read started by start has completed,
+// advancing the read otherwise. It must be called frequently while
+// starting, since the start signal ends on the first call after its
+// duration, which must not exceed 20ms.
+bool DHT::ready(void) {
+  uint32_t elapsed = micros() - _starttime;
+  switch (_state) {
+  case idle:
+    return true;
+
+  case starting:
+    if (elapsed < (_type == DHT11 ? START_DHT11 : START_DHT22)) {
+      return false;
     }
-    if (expectPulse(HIGH) == 0) {
-      DEBUG_PRINTLN(F("Timeout waiting for start signal high pulse."));
-      _lastresult = false;
-      return _lastresult;
+    // End the start signal by releasing the data line, then record
+    // edges as the sensor responds.
+    _edgecount = 0;
+    pinMode(_pin, INPUT_PULLUP);
+    attachInterruptArg(digitalPinToInterrupt(_pin), isr, this, CHANGE);
+    _starttime = micros();
+    _state = receiving;
+    return false;
+
+  case receiving:
+    if (elapsed < FRAME_PERIOD) {
+      return false;
     }
+    detachInterrupt(digitalPinToInterrupt(_pin));
+    _lastresult = decode();
+    _state = idle;
+    return true;
+  }
+  return true;
+}
 
-    // Now read the 40 bits sent by the sensor.  Each bit is sent as a 50
-    // microsecond low pulse followed by a variable length high pulse.  If the
-    // high pulse is ~28 microseconds then it's a 0 and if it's ~70 microseconds
-    // then it's a 1.  We measure the cycle count of the initial 50us low pulse
-    // and use that to compare to the cycle count of the high pulse to determine
-    // if the bit is a 0 (high state cycle count < low state cycle count), or a
-    // 1 (high state cycle count > low state cycle count). Note that for speed all
-    // the pulses are read into a array and then examined in a later step.
-    for (int i=0; i<80; i+=2) {
-      cycles[i]   = expectPulse(LOW);
-      cycles[i+1] = expectPulse(HIGH);
-    }
-  } // Timing critical code is now complete.
+// isr records the time of each edge on the data line.
+void ICACHE_RAM_ATTR DHT::isr(void* arg) {
+  DHT* dht = (DHT*)arg;
+  if (dht->_edgecount < DHT_EDGES) {
+    dht->_edges[dht->_edgecount++] = micros();
+  }
+}
+
+// decode converts recorded edges to 40 bits of data, returning true if
+// the checksum matches. Each bit is sent as a 50 microsecond low pulse
+// followed by a variable length high pulse. If the high pulse is ~28
+// microseconds then it's a 0 and if it's ~70 microseconds then it's a 1.
+// The frame ends with a final low pulse, so it is decoded backwards from
+// the last edge, which is robust to missing the sensor's initial response.
+bool DHT::decode(void) {
+  int nn = _edgecount;
 
-  // Inspect pulses and determine which ones are 0 (high state cycle count < low
-  // state cycle count), or 1 (high state cycle count > low state cycle count).
+  // Reset 40 bits of received data to zero.
+  data[0] = data[1] = data[2] = data[3] = data[4] = 0;
+
+  if (nn < 82) {
+    DEBUG_PRINT(F("Timeout waiting for pulses, edges: ")); DEBUG_PRINTLN(nn);
+    return false;
+  }
   for (int i=0; i<40; ++i) {
-    uint32_t lowCycles  = cycles[2*i];
-    uint32_t highCycles = cycles[2*i+1];
-    if ((lowCycles == 0) || (highCycles == 0)) {
-      DEBUG_PRINTLN(F("Timeout waiting for pulse."));
-      _lastresult = false;
-      return _lastresult;
-    }
+    int fall = nn - 2 - 2*(39 - i); // Falling edge ending the high pulse of bit i.
+    uint32_t lowTime  = _edges[fall-1] - _edges[fall-2];
+    uint32_t highTime = _edges[fall] - _edges[fall-1];
     data[i/8] <<= 1;
-    // Now compare the low and high cycle times to see if the bit is a 0 or 1.
-    if (highCycles > lowCycles) {
-      // High cycles are greater than 50us low cycle count, must be a 1.
+    // Now compare the low and high times to see if the bit is a 0 or 1.
+    if (highTime > lowTime) {
+      // High time is greater than the 50us low time, must be a 1.
       data[i/8] |= 1;
     }
-    // Else high cycles are less than (or equal to, a weird case) the 50us low
-    // cycle count so this must be a zero.  Nothing needs to be changed in the
-    // stored data.
   }
 
   DEBUG_PRINTLN(F("Received:"));
@@ -215,45 +234,10 @@ boolean DHT::read(bool force) {
   DEBUG_PRINT(data[4], HEX); DEBUG_PRINT(F(" =? "));
   DEBUG_PRINTLN((data[0] + data[1] + data[2] + data[3]) & 0xFF, HEX);
 
-  // Check we read 40 bits and that the checksum matches.
+  // Check that the checksum matches.
   if (data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF)) {
-    _lastresult = true;
-    return _lastresult;
+    return true;
   }
-  else {
-    DEBUG_PRINTLN(F("Checksum failure!"));
-    _lastresult = false;
-    return _lastresult;
-  }
-}
-
-// Expect the signal line to be at the specified level for a period of time and
-// return a count of loop cycles spent at that level (this cycle count can be
-// used to compare the relative time of two pulses).  If more than a millisecond
-// ellapses without the level changing then the call fails with a 0 response.
-// This is adapted from Arduino's pulseInLong function (which is only available
-// in the very latest IDE versions):
-//   https://github.com/arduino/Arduino/blob/master/hardware/arduino/avr/cores/arduino/wiring_pulse.c
-uint32_t DHT::expectPulse(bool level) {
-  uint32_t count = 0;
-  // On AVR platforms use direct GPIO port access as it's much faster and better
-  // for catching pulses that are 10's of microseconds in length:
-  #ifdef __AVR
-    uint8_t portState = level ? _bit : 0;
-    while ((*portInputRegister(_port) & _bit) == portState) {
-      if (count++ >= _maxcycles) {
-        return 0; // Exceeded timeout, fail.
-      }
-    }
-  // Otherwise fall back to using digitalRead (this seems to be necessary on ESP8266
-  // right now, perhaps bugs in direct port access functions?).
-  #else
-    while (digitalRead(_pin) == level) {
-      if (count++ >= _maxcycles) {
-        return 0; // Exceeded timeout, fail.
-      }
-    }
-  #endif
-
-  return count;
+  DEBUG_PRINTLN(F("Checksum failure!"));
+  return false;
 }
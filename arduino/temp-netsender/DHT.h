@@ -35,6 +35,15 @@ written by Adafruit Industries
 #define AM2301 21
 
 
+// Number of edges recorded per read, i.e., 3 for the response, 80 for
+// the data and 1 as the sensor releases the line, plus some slack.
+#define DHT_EDGES 88
+
+// DHT reads are driven by edge interrupts, with interrupts left enabled,
+// so that WiFi and other sensors are serviced while a read is in
+// progress. To read several sensors concurrently, call start for
+// each, then wait for each to be ready. readTemperature and
+// readHumidity then return the results without reading again.
 class DHT {
   public:
    DHT(uint8_t pin, uint8_t type, uint8_t count=6);
@@ -45,30 +54,20 @@ class DHT {
    float computeHeatIndex(float temperature, float percentHumidity, bool isFahrenheit=true);
    float readHumidity(bool force=false);
    boolean read(bool force=false);
+   void start(void);
+   bool ready(void);
 
  private:
+  enum { idle, starting, receiving } _state;
   uint8_t data[5];
   uint8_t _pin, _type;
-  #ifdef __AVR
-    // Use direct GPIO access on an 8-bit AVR so keep track of the port and bitmask
-    // for the digital pin connected to the DHT.  Other platforms will use digitalRead.
-    uint8_t _bit, _port;
-  #endif
-  uint32_t _lastreadtime, _maxcycles;
+  uint32_t _lastreadtime, _starttime;
   bool _lastresult;
+  volatile uint8_t _edgecount;
+  volatile uint32_t _edges[DHT_EDGES]; // Edge times in microseconds.
 
-  uint32_t expectPulse(bool level);
-
-};
-
-class InterruptLock {
-  public:
-   InterruptLock() {
-    noInterrupts();
-   }
-   ~InterruptLock() {
-    interrupts();
-   }
+  bool decode(void);
+  static void isr(void* arg);
 
 };
 
@@ -112,6 +112,7 @@ void setup() {
   dht.begin();
   dt.begin();
   NetSender::ExternalReader = &tempReader;
+  NetSender::EarlyWiFi = true; // DHT reads are slow, so associate meanwhile.
   NetSender::init();
   loop();
 }
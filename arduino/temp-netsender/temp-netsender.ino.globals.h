@@ -0,0 +1,9 @@
+/*
+  Global build defines for temp-netsender, which the ESP8266 core
+  (3.1.0 and later) applies to all sources, including NetSender.
+  Temperature sensors require neither pulses nor power pins.
+  See NetSenderTraits in NetSender.h.
+*/
+
+#define NETSENDER_NO_PULSES
+#define NETSENDER_NO_POWER
@@ -3,6 +3,8 @@
  * - Cleaned up variables names, removed dead code, made naming consistent (CamelCase)
  * - Reduced wind vane from 16 to 8 positions and recalibrated (YMMV)
  * - Removed ADMode
+ * - Replaced sample and delay modes with background accumulation of wind
+ *   and rain statistics, which persist across deep sleep in RTC memory
  * 
  * Original description: 
  * SDLWeather.cpp - Library for SwitchDoc Labs WeatherRack.
@@ -23,29 +25,57 @@
 #define RAIN_FACTOR 0.2794    // rain bucket sensor
 #define WIND_FACTOR 2.400     // anemometer sensor
 #define VANE_TOLERANCE 0.05   // Volts
+#define RTC_MAGIC 0x574452    // RTC data magic number ("WDR")
 
 // globals updated by interrupt handlers
 volatile unsigned long LastWindTime;
 volatile unsigned long LastRainTime;
 
 // static members updated by interrupt handlers
-long SDLWeather::_currentWindCount = 0;
-long SDLWeather::_currentRainCount = 0;
-unsigned long SDLWeather::_shortestWindTime = 0;
+volatile long SDLWeather::_currentWindCount = 0;
+volatile long SDLWeather::_currentRainCount = 0;
+volatile unsigned long SDLWeather::_shortestWindTime = 0;
+
+// WeatherRtc is the accumulated state stored in RTC user memory,
+// which persists across deep sleep but not power loss.
+typedef struct {
+  uint32_t check;            // Checksum of the remainder of the struct.
+  long windCount;
+  unsigned long windTime;    // Milliseconds sampled.
+  unsigned long shortestWindTime;
+  long rainCount;
+  long totalRainCount;
+  float vaneX;
+  float vaneY;
+  long vaneSamples;
+} WeatherRtc;
+
+// checksum returns the checksum of RTC data, excluding the checksum itself.
+uint32_t checksum(WeatherRtc* rtc) {
+  uint32_t sum = RTC_MAGIC;
+  uint32_t* words = (uint32_t*)rtc;
+  for (size_t ii = 1; ii < sizeof(WeatherRtc) / 4; ii++) {
+    sum = (sum << 1 | sum >> 31) ^ words[ii];
+  }
+  return sum;
+}
 
 SDLWeather::SDLWeather(int pinAnem, int pinRain, int ADChannel) {
   _pinAnem = pinAnem;
   _pinRain = pinRain;
   _ADChannel = ADChannel;
+  _rtcBlock = -1;
 
   _currentRainCount = 0;
   _currentWindCount = 0;
-  _currentWindSpeed = 0.0;
   _currentWindDirection = 0;
   _shortestWindTime = 0xffffffff;
-  _samplePeriod = 5.0;
-  _selectedMode = SDL_MODE_SAMPLE;
-  _startSampleTime = micros();
+  _windTime = 0;
+  _startSampleTime = millis();
+  _totalRainCount = 0;
+  _vaneX = 0;
+  _vaneY = 0;
+  _vaneSamples = 0;
    
    // set up interrupts
   pinMode(_pinAnem, INPUT_PULLUP);  // pin for anenometer interrupts
@@ -56,27 +86,105 @@ SDLWeather::SDLWeather(int pinAnem, int pinRain, int ADChannel) {
   attachInterrupt(digitalPinToInterrupt(_pinRain), serviceInterruptRain, RISING);
 }
 
+// begin restores statistics accumulated prior to the last deep sleep
+// from RTC user memory, starting at the given block, then samples
+// the wind vane and saves statistics every SDL_TICK_PERIOD seconds.
+// Counts accumulated since construction are retained.
+// NB: the anemometer and rain bucket are not counted during deep sleep.
+void SDLWeather::begin(int rtcBlock) {
+  WeatherRtc rtc;
+  _rtcBlock = rtcBlock;
+  ESP.rtcUserMemoryRead(_rtcBlock, (uint32_t*)&rtc, sizeof(rtc));
+  if (rtc.check == checksum(&rtc)) {
+    noInterrupts();
+    _currentWindCount += rtc.windCount;
+    _currentRainCount += rtc.rainCount;
+    if (rtc.shortestWindTime < _shortestWindTime) {
+      _shortestWindTime = rtc.shortestWindTime;
+    }
+    interrupts();
+    _windTime = rtc.windTime;
+    _totalRainCount = rtc.totalRainCount;
+    _vaneX = rtc.vaneX;
+    _vaneY = rtc.vaneY;
+    _vaneSamples = rtc.vaneSamples;
+  }
+  _ticker.attach(SDL_TICK_PERIOD, tick, this);
+}
+
+// save saves statistics to RTC user memory, if begin has been called.
+void SDLWeather::save() {
+  WeatherRtc rtc;
+  if (_rtcBlock < 0) {
+    return;
+  }
+  noInterrupts();
+  rtc.windCount = _currentWindCount;
+  rtc.rainCount = _currentRainCount;
+  rtc.shortestWindTime = _shortestWindTime;
+  interrupts();
+  rtc.windTime = _windTime + (millis() - _startSampleTime);
+  rtc.totalRainCount = _totalRainCount;
+  rtc.vaneX = _vaneX;
+  rtc.vaneY = _vaneY;
+  rtc.vaneSamples = _vaneSamples;
+  rtc.check = checksum(&rtc);
+  ESP.rtcUserMemoryWrite(_rtcBlock, (uint32_t*)&rtc, sizeof(rtc));
+}
+
+// tick samples the wind vane, accumulating unit vectors so that the
+// mean direction wraps correctly, e.g., 315 and 45 average to 0, not 180.
+void SDLWeather::tick(SDLWeather* weather) {
+  float direction = weather->readWindDirection();
+  weather->_vaneX += cos(direction * DEG_TO_RAD);
+  weather->_vaneY += sin(direction * DEG_TO_RAD);
+  weather->_vaneSamples++;
+  weather->save();
+}
+
+// getCurrentRainTotal returns the rainfall since last called.
 float SDLWeather::getCurrentRainTotal() {
-  float rain_amount = RAIN_FACTOR * _currentRainCount / 2;  // mm of rain - we get two interrupts per bucket
+  noInterrupts();
+  long count = _currentRainCount;
   _currentRainCount = 0;
-  return rain_amount;
+  interrupts();
+  _totalRainCount += count;
+  save();
+  return RAIN_FACTOR * count / 2; // mm of rain - we get two interrupts per bucket
 }
 
-float SDLWeather::getWindSpeed() { // in milliseconds
-  if (_selectedMode == SDL_MODE_SAMPLE) {
-    _currentWindSpeed = getCurrentWindSpeedWhenSampling();
-  } else {
-    // km/h * 1000 msec
-    _currentWindCount = 0;
-    delay(_samplePeriod * 1000);
-    _currentWindSpeed = ((float)_currentWindCount/_samplePeriod) * WIND_FACTOR;
-   }
-  return _currentWindSpeed;
+// getRainTotal returns the rainfall since power up.
+float SDLWeather::getRainTotal() {
+  getCurrentRainTotal();
+  return RAIN_FACTOR * _totalRainCount / 2;
 }
 
+// getWindSpeed returns the mean wind speed since last called, in km/h,
+// without blocking.
+float SDLWeather::getWindSpeed() {
+  noInterrupts();
+  long count = _currentWindCount;
+  _currentWindCount = 0;
+  interrupts();
+  unsigned long now = millis();
+  unsigned long elapsed = _windTime + (now - _startSampleTime);
+  _windTime = 0;
+  _startSampleTime = now;
+  save();
+  if (elapsed == 0) {
+    return 0.0;
+  }
+  return ((float)count / elapsed) * WIND_FACTOR * 1000;
+}
+
+// getWindGust returns the peak wind speed since last called, in km/h,
+// which is derived from the shortest time between anemometer interrupts.
 float SDLWeather::getWindGust() {
+  noInterrupts();
   unsigned long latestTime = _shortestWindTime; // elapsed
-  _shortestWindTime=0xffffffff;  // reset
+  _shortestWindTime = 0xffffffff;  // reset
+  interrupts();
+  save();
   double time = latestTime/1000000.0;  // in microseconds
   return (1/(time)) * WIND_FACTOR / 2; 
 }
@@ -95,43 +203,31 @@ int voltageToVane(float value) {
   return -1; // wind vane lookup failed
 }
 
-float SDLWeather::getWindDirection() {
+// readWindDirection reads the wind vane, returning the last direction if the lookup fails.
+float SDLWeather::readWindDirection() {
   float voltageValue = (analogRead(_ADChannel)/1023.0) * ADC_VOLTAGE / ADC_V_DIVIDE;
   int vane = voltageToVane(voltageValue);
-  if (vane == -1) {
-    return _currentWindDirection;
-  } else {  
-    return vane * 45.0;
+  if (vane != -1) {
+    _currentWindDirection = vane * 45.0;
   }
+  return _currentWindDirection;
 }
 
-// ongoing samples in wind
-void SDLWeather::startWindSample(float samplePeriod) {
-  _startSampleTime = micros();
-  _samplePeriod = samplePeriod;
-}
-
-float SDLWeather::getCurrentWindSpeedWhenSampling() {
-  unsigned long compareValue = _samplePeriod * 1000000;
-  
-  if (micros() - _startSampleTime >= compareValue) {
-    // sample time exceeded, calculate currentWindSpeed
-    float _timeSpan;
-    _timeSpan = (micros() - _startSampleTime);
-    _currentWindSpeed = ((float)_currentWindCount/(_timeSpan)) * WIND_FACTOR * 1000000;
-    _currentWindCount = 0;
-    _startSampleTime = micros();
-  } // else return current wind speed
-  return _currentWindSpeed;
-}
-
-void SDLWeather::setWindMode(int selectedMode, float samplePeriod) {
-  _samplePeriod = samplePeriod; // in seconds
-  _selectedMode = selectedMode;
-  
-  if (_selectedMode == SDL_MODE_SAMPLE) {
-    startWindSample(_samplePeriod);
+// getWindDirection returns the mean wind direction since last called,
+// in degrees, or the current direction if the vane has not been sampled.
+float SDLWeather::getWindDirection() {
+  if (_vaneSamples == 0) {
+    return readWindDirection();
+  }
+  float direction = atan2(_vaneY, _vaneX) * RAD_TO_DEG;
+  if (direction < 0) {
+    direction += 360.0;
   }
+  _vaneX = 0;
+  _vaneY = 0;
+  _vaneSamples = 0;
+  save();
+  return direction;
 }
 
 // interrupt handlers, which mostly just update counts
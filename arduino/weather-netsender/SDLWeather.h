@@ -11,12 +11,11 @@
 #ifndef SDLWeather_h
 #define SDLWeather_h
 
-// sample mode means return immediately.  The wind speed is averaged over samplePeriod or when you ask, whichever is longer
-#define SDL_MODE_SAMPLE 0
-// Delay mode means to wait for samplePeriod and the average after that time.
-#define SDL_MODE_DELAY 1
-
 #include "Arduino.h"
+#include <Ticker.h>
+
+// Interval between wind vane samples and saving of statistics, in seconds.
+#define SDL_TICK_PERIOD 1.0
 
 extern "C" void serviceInterruptAnem(void)  __attribute__ ((signal));
 extern "C" void serviceInterruptRain(void)  __attribute__ ((signal));
@@ -24,16 +23,17 @@ class SDLWeather
 {
   public:
   SDLWeather(int pinAnem, int pinRain, int ADChannel);
-  
+
+  void begin(int rtcBlock);
   float getCurrentRainTotal();
+  float getRainTotal();
   float getWindSpeed();
   float getWindDirection();
   float getWindGust();
-  void setWindMode(int selectedMode, float samplePeriod);
   
-  static unsigned long _shortestWindTime;
-  static long _currentRainCount;
-  static long _currentWindCount;
+  static volatile unsigned long _shortestWindTime;
+  static volatile long _currentRainCount;
+  static volatile long _currentWindCount;
     
   friend void serviceInterruptAnem();
   friend void serviceInterruptRain(); 
@@ -42,17 +42,20 @@ class SDLWeather
   int _pinAnem;
   int _pinRain;    
   int _ADChannel;
-  float _samplePeriod;
-  int _selectedMode;
-    
-  unsigned long _startSampleTime;
+  int _rtcBlock;
+  Ticker _ticker;
 
-  float _currentWindSpeed;
+  unsigned long _windTime;       // Milliseconds sampled before _startSampleTime.
+  unsigned long _startSampleTime;
+  long _totalRainCount;          // Rain count prior to the current count.
+  float _vaneX;                  // Sum of wind vane unit vectors.
+  float _vaneY;
+  long _vaneSamples;
   float _currentWindDirection;
-    
-  void startWindSample(float sampleTime);
-  float getCurrentWindSpeedWhenSampling();
+
+  float readWindDirection();
+  void save();
+  static void tick(SDLWeather* weather);
 };
 
 #endif
-
@@ -28,7 +28,13 @@ DESCRIPTION
     X32 = True Wind Angle (TWA)
     X33 = Total rainfall (Precipitation) (PPT)
 
-  Note that the total rainfall is reset to zero upon startup.
+  Wind speed, gust and angle are the mean, peak and mean values
+  respectively since the previous reading, i.e., over the monitoring
+  period. They are accumulated in the background and saved to RTC
+  memory so that they span deep sleep, although the ESP8266 does not
+  count while deep sleeping.
+
+  Note that the total rainfall is reset to zero upon power up.
 
 SEE ALSO
   NetReceiver help: http://netreceiver.appspot.com/help.
@@ -55,7 +61,6 @@ LICENSE
 #include "SDLWeather.h"
 
 SDLWeather WeatherStation(4, 5, A0);
-float RainTotal = 0.0;
 int varsum;
 
 int weatherReader(NetSender::Pin *pin) {
@@ -75,8 +80,7 @@ int weatherReader(NetSender::Pin *pin) {
     pin->value = 10 * WeatherStation.getWindDirection();
     break;
   case 33: // PPT
-    RainTotal += WeatherStation.getCurrentRainTotal();
-    pin->value = 10 * RainTotal;
+    pin->value = 10 * WeatherStation.getRainTotal();
     break;
   default:
     return -1;
@@ -89,11 +93,12 @@ int weatherReader(NetSender::Pin *pin) {
 void setup(void) {
   NetSender::ExternalReader = &weatherReader;
   NetSender::init();
+  WeatherStation.begin(RTC_USER_BLOCK);
   loop();
 }
 
 void loop() {
   while (!NetSender::run(&varsum)) {
-    delay(RETRY_PERIOD * (long)1000);
+    ;
   }
 }